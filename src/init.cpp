@@ -164,6 +164,24 @@ static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 
 static boost::thread_group threadGroup;
 static CScheduler scheduler;
+
+// masternode, budget and payment caches, read from disk while the block index loads
+static boost::thread* pthreadLoadMasternodeCaches = NULL;
+static CMasternodeDB::ReadResult readResultMasternodes = CMasternodeDB::FileError;
+static CBudgetDB::ReadResult readResultBudget = CBudgetDB::FileError;
+static CMasternodePaymentDB::ReadResult readResultPayments = CMasternodePaymentDB::FileError;
+static bool fMasternodeCachesLoaded = false;
+
+/** Wait for ThreadLoadMasternodeCaches, if it was started */
+static void WaitForMasternodeCaches()
+{
+    if (pthreadLoadMasternodeCaches == NULL) return;
+
+    pthreadLoadMasternodeCaches->join();
+    delete pthreadLoadMasternodeCaches;
+    pthreadLoadMasternodeCaches = NULL;
+}
+
 void Interrupt()
 {
     InterruptHTTPServer();
@@ -200,9 +218,16 @@ void PrepareShutdown()
     GenerateBitcoins(false, NULL, 0);
 #endif
     StopNode();
-    DumpMasternodes();
-    DumpBudgets();
-    DumpMasternodePayments();
+    // Only dump caches that were completely loaded, or the dump would
+    // overwrite them with the part that was read so far.
+    WaitForMasternodeCaches();
+    if (fMasternodeCachesLoaded) {
+        boost::thread_group dumpGroup;
+        dumpGroup.create_thread(&DumpMasternodes);
+        dumpGroup.create_thread(&DumpBudgets);
+        dumpGroup.create_thread(&DumpMasternodePayments);
+        dumpGroup.join_all();
+    }
     UnregisterNodeSignals(GetNodeSignals());
 
     // After everything has been shut down, but before things get flushed, stop the
@@ -210,6 +235,11 @@ void PrepareShutdown()
     threadGroup.interrupt_all();
     threadGroup.join_all();
 
+    // Only dump a mempool that was completely loaded, or the dump would
+    // overwrite mempool.dat with the part that was read so far.
+    if (fMempoolLoaded && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
+
     if (fFeeEstimatesInitialized) {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
         CAutoFile est_fileout(fopen(est_path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
@@ -384,7 +414,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).MaxReorganizationDepth()));
+    strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphanpeerbytes=<n>", strprintf(_("Keep at most <n> bytes of unconnectable transactions from a single peer (default: %u)"), DEFAULT_MAX_ORPHAN_PEER_BYTES));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "StakeCenterCashd.pid"));
@@ -407,12 +441,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-dns", _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)"));
     strUsage += HelpMessageOpt("-dnsseed", _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)"));
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
+    strUsage += HelpMessageOpt("-fetchorphanparents", strprintf(_("Request the missing parents of received orphan transactions from the sending peer (default: %u)"), DEFAULT_FETCH_ORPHAN_PARENTS));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
     strUsage += HelpMessageOpt("-listenonion", strprintf(_("Automatically create Tor hidden service (default: %d)"), DEFAULT_LISTEN_ONION));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -476,6 +512,7 @@ std::string HelpMessage(HelpMessageMode mode)
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+        strUsage += HelpMessageOpt("-checkmempoolbudget=<n>", strprintf("Without -checkmempool, spend up to <n> microseconds per mempool check verifying the entries changed since the last check and log inconsistencies (default: %u, 0 = off)", DEFAULT_CHECKMEMPOOL_BUDGET));
         strUsage += HelpMessageOpt("-checkpoints", strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1));
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0));
@@ -505,6 +542,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf(_("Require high priority for relaying free or low-fee transactions (default:%u)"), 1));
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000));
+        strUsage += HelpMessageOpt("-maxmnsigcachesize=<n>", strprintf(_("Limit size of the masternode message signer cache to <n> entries (default: %u)"), DEFAULT_MAX_MN_SIG_CACHE_SIZE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in STAKEC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-printtoconsole", strprintf(_("Send trace/debug info to console instead of debug.log file (default: %u)"), 0));
@@ -671,6 +709,24 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
+    fMempoolLoaded = !ShutdownRequested();
+}
+
+void ThreadLoadMasternodeCaches()
+{
+    RenameThread("StakeCenterCash-loadmn");
+
+    CMasternodeDB mndb;
+    readResultMasternodes = mndb.Read(mnodeman);
+
+    CBudgetDB budgetdb;
+    readResultBudget = budgetdb.Read(budget);
+
+    CMasternodePaymentDB mnpayments;
+    readResultPayments = mnpayments.Read(masternodePayments);
 }
 
 /** Sanity checks
@@ -895,6 +951,7 @@ bool AppInit2()
 
     // Checkmempool and checkblockindex default to true in regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", Params().DefaultConsistencyChecks()));
+    mempool.setCheckBudget(GetArg("-checkmempoolbudget", DEFAULT_CHECKMEMPOOL_BUDGET));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().DefaultConsistencyChecks());
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
@@ -1226,6 +1283,10 @@ bool AppInit2()
         }
     }
 
+    if (mapArgs.count("-maxuploadtarget")) {
+        CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET) * 1024 * 1024);
+    }
+
     // Check for host lookup allowed before parsing any network related parameters
     fNameLookup = GetBoolArg("-dns", DEFAULT_NAME_LOOKUP);
 
@@ -1324,6 +1385,9 @@ bool AppInit2()
 
     // ********************************************************* Step 7: load block chain
 
+    // the masternode caches don't depend on the chain, read them in the meantime
+    pthreadLoadMasternodeCaches = new boost::thread(&ThreadLoadMasternodeCaches);
+
     fReindex = GetBoolArg("-reindex", false);
 
     // Create blocks directory if it doesn't already exist
@@ -1586,6 +1650,16 @@ bool AppInit2()
 #endif // !ENABLE_WALLET
     // ********************************************************* Step 9: import blocks
 
+    uiInterface.InitMessage(_("Loading masternode cache..."));
+    WaitForMasternodeCaches();
+
+    // catch the last paid index up with the chain before connecting more blocks to it, this
+    // also rebuilds it from the recent blocks when the cache was missing or unreadable
+    mnodeman.RescanLastPaid();
+
+    // watch for collateral spends before any block is connected
+    RegisterValidationInterface(&mnodeman);
+
     if (mapArgs.count("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
 
@@ -1617,30 +1691,32 @@ bool AppInit2()
 
     // ********************************************************* Step 10: setup Masternode
 
-    uiInterface.InitMessage(_("Loading masternode cache..."));
-
-    CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
-    if (readResult == CMasternodeDB::FileError)
+    if (readResultMasternodes == CMasternodeDB::Ok) {
+        mnodeman.CheckCollaterals();
+        LogPrint("masternode","Masternode manager - cleaning....\n");
+        mnodeman.CheckAndRemove(true);
+        LogPrint("masternode","Masternode manager - result:\n");
+        LogPrint("masternode","  %s\n", mnodeman.ToString());
+    } else if (readResultMasternodes == CMasternodeDB::FileError)
         LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
+    else {
         LogPrintf("Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
+        if (readResultMasternodes == CMasternodeDB::IncorrectFormat)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
 
-    uiInterface.InitMessage(_("Loading budget cache..."));
-
-    CBudgetDB budgetdb;
-    CBudgetDB::ReadResult readResult2 = budgetdb.Read(budget);
-
-    if (readResult2 == CBudgetDB::FileError)
+    if (readResultBudget == CBudgetDB::Ok) {
+        LogPrint("mnbudget","Budget manager - cleaning....\n");
+        budget.CheckAndRemove();
+        LogPrint("mnbudget","Budget manager - result:\n");
+        LogPrint("mnbudget","  %s\n", budget.ToString());
+    } else if (readResultBudget == CBudgetDB::FileError)
         LogPrintf("Missing budget cache - budget.dat, will try to recreate\n");
-    else if (readResult2 != CBudgetDB::Ok) {
+    else {
         LogPrintf("Error reading budget.dat: ");
-        if (readResult2 == CBudgetDB::IncorrectFormat)
+        if (readResultBudget == CBudgetDB::IncorrectFormat)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
@@ -1650,22 +1726,23 @@ bool AppInit2()
     budget.ResetSync();
     budget.ClearSeen();
 
-
-    uiInterface.InitMessage(_("Loading masternode payment cache..."));
-
-    CMasternodePaymentDB mnpayments;
-    CMasternodePaymentDB::ReadResult readResult3 = mnpayments.Read(masternodePayments);
-
-    if (readResult3 == CMasternodePaymentDB::FileError)
+    if (readResultPayments == CMasternodePaymentDB::Ok) {
+        LogPrint("masternode","Masternode payments manager - cleaning....\n");
+        masternodePayments.CleanPaymentList();
+        LogPrint("masternode","Masternode payments manager - result:\n");
+        LogPrint("masternode","  %s\n", masternodePayments.ToString());
+    } else if (readResultPayments == CMasternodePaymentDB::FileError)
         LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
-    else if (readResult3 != CMasternodePaymentDB::Ok) {
+    else {
         LogPrintf("Error reading mnpayments.dat: ");
-        if (readResult3 == CMasternodePaymentDB::IncorrectFormat)
+        if (readResultPayments == CMasternodePaymentDB::IncorrectFormat)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
 
+    fMasternodeCachesLoaded = true;
+
     fMasterNode = GetBoolArg("-masternode", false);
 
     if ((fMasterNode || masternodeConfig.getCount() > -1) && fTxIndex == false) {
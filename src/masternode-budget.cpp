@@ -322,11 +322,8 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
     return true;
 }
 
-CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
+CBudgetDB::ReadResult CBudgetDB::ReadFile(CDataStream& ssObj)
 {
-    LOCK(objToLoad.cs);
-
-    int64_t nStart = GetTimeMillis();
     // open input file, and associate with CAutoFile
     FILE* file = fopen(pathDB.string().c_str(), "rb");
     CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
@@ -341,13 +338,12 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
     // Don't try to resize to a negative number if file is small
     if (dataSize < 0)
         dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
+    ssObj.resize(dataSize);
     uint256 hashIn;
 
     // read data and checksum from file
     try {
-        filein.read((char*)&vchData[0], dataSize);
+        filein.read((char*)&ssObj[0], dataSize);
         filein >> hashIn;
     } catch (std::exception& e) {
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -355,8 +351,6 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
     }
     filein.fclose();
 
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
     // verify stored checksum matches input data
     uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
     if (hashIn != hashTmp) {
@@ -364,7 +358,6 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
         return IncorrectHash;
     }
 
-
     unsigned char pchMsgTmp[4];
     std::string strMagicMessageTmp;
     try {
@@ -377,7 +370,6 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
             return IncorrectMagicMessage;
         }
 
-
         // de-serialize file header (network specific magic number) and ..
         ssObj >> FLATDATA(pchMsgTmp);
 
@@ -386,7 +378,32 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
             error("%s : Invalid network magic number", __func__);
             return IncorrectMagicNumber;
         }
+    } catch (std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+
+    return Ok;
+}
 
+CBudgetDB::ReadResult CBudgetDB::Verify()
+{
+    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
+    return ReadFile(ssObj);
+}
+
+CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad)
+{
+    LOCK(objToLoad.cs);
+
+    int64_t nStart = GetTimeMillis();
+
+    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
+    ReadResult result = ReadFile(ssObj);
+    if (result != Ok)
+        return result;
+
+    try {
         // de-serialize data into CBudgetManager object
         ssObj >> objToLoad;
     } catch (std::exception& e) {
@@ -397,12 +414,6 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
 
     LogPrint("mnbudget","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("mnbudget","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("mnbudget","Budget manager - cleaning....\n");
-        objToLoad.CheckAndRemove();
-        LogPrint("mnbudget","Budget manager - result:\n");
-        LogPrint("mnbudget","  %s\n", objToLoad.ToString());
-    }
 
     return Ok;
 }
@@ -412,10 +423,10 @@ void DumpBudgets()
     int64_t nStart = GetTimeMillis();
 
     CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
 
+    // only the header and checksum are checked, the data itself is ours to overwrite
     LogPrint("mnbudget","Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
+    CBudgetDB::ReadResult readResult = budgetdb.Verify();
     // there was an error and it was not an error on file opening => do not proceed
     if (readResult == CBudgetDB::FileError)
         LogPrint("mnbudget","Missing budgets file - budget.dat, will try to recreate\n");
@@ -174,9 +174,16 @@ public:
         IncorrectFormat
     };
 
+private:
+    /// Read the whole file into the stream and check it, leaving the stream at the data
+    ReadResult ReadFile(CDataStream& ssObj);
+
+public:
     CBudgetDB();
     bool Write(const CBudgetManager& objToSave);
-    ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
+    /// Check the header and checksum of the file without loading it
+    ReadResult Verify();
+    ReadResult Read(CBudgetManager& objToLoad);
 };
 
 
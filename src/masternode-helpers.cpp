@@ -10,6 +10,7 @@
 #include "masternodeman.h"
 #include "activemasternode.h"
 #include "masternode-payments.h"
+#include "random.h"
 #include "swifttx.h"
 
 // A helper object for signing messages from Masternodes
@@ -27,6 +28,9 @@ void ThreadMasternodePool()
     while (true) {
         MilliSleep(1000);
 
+        // add the Masternode broadcasts received since the last round
+        mnodeman.ProcessBroadcastQueue();
+
         // try to sync from all available nodes, one step at a time
         masternodeSync.Process();
 
@@ -38,6 +42,7 @@ void ThreadMasternodePool()
             if (c % MASTERNODE_PING_SECONDS == 0) activeMasternode.ManageStatus();
 
             if (c % 60 == 0) {
+                mnodeman.CheckCollaterals();
                 mnodeman.CheckAndRemove();
                 mnodeman.ProcessMasternodeConnections();
                 masternodePayments.CleanPaymentList();
@@ -47,24 +52,6 @@ void ThreadMasternodePool()
     }
 }
 
-bool CMasternodeSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey)
-{
-    CScript payee2;
-    payee2 = GetScriptForDestination(pubkey.GetID());
-
-    CTransaction txVin;
-    uint256 hash;
-    if (GetTransaction(vin.prevout.hash, txVin, hash, true)) {
-        BOOST_FOREACH (CTxOut out, txVin.vout) {
-            if (out.nValue == GetMasternodeCollateral() * COIN) {
-                if (out.scriptPubKey == payee2) return true;
-            }
-        }
-    }
-
-    return false;
-}
-
 bool CMasternodeSigner::SetKey(std::string strSecret, std::string& errorMessage, CKey& key, CPubKey& pubkey)
 {
     CBitcoinSecret vchSecret;
@@ -107,22 +94,107 @@ bool CMasternodeSigner::SignMessage(std::string strMessage, std::string& errorMe
     return true;
 }
 
+namespace {
+
+/**
+ * Cache of public key IDs recovered from compact message signatures. Masternode,
+ * budget, swifttx, payment and spork messages are relayed by many peers, so the
+ * same (message, signature) pair is typically verified several times before the
+ * seen-maps catch it. Entries are keyed by a salted hash so that peers cannot
+ * predict which entries collide or get evicted.
+ */
+class CRecoveredKeyCache
+{
+private:
+    uint256 nSalt;
+    std::map<uint256, CKeyID> mapRecovered;
+    uint64_t nHits;
+    uint64_t nMisses;
+    mutable CCriticalSection cs_cache;
+
+    uint256 GetEntryHash(const uint256& hashMessage, const std::vector<unsigned char>& vchSig) const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << nSalt << hashMessage << vchSig;
+        return ss.GetHash();
+    }
+
+public:
+    CRecoveredKeyCache() : nSalt(GetRandHash()), nHits(0), nMisses(0) {}
+
+    bool Get(const uint256& hashMessage, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet)
+    {
+        uint256 hashEntry = GetEntryHash(hashMessage, vchSig);
+
+        LOCK(cs_cache);
+        std::map<uint256, CKeyID>::const_iterator it = mapRecovered.find(hashEntry);
+        if (it == mapRecovered.end()) {
+            nMisses++;
+            return false;
+        }
+        nHits++;
+        keyIDRet = it->second;
+        return true;
+    }
+
+    void Set(const uint256& hashMessage, const std::vector<unsigned char>& vchSig, const CKeyID& keyID)
+    {
+        int64_t nMaxCacheSize = GetArg("-maxmnsigcachesize", DEFAULT_MAX_MN_SIG_CACHE_SIZE);
+        if (nMaxCacheSize <= 0) return;
+
+        uint256 hashEntry = GetEntryHash(hashMessage, vchSig);
+
+        LOCK(cs_cache);
+        while (static_cast<int64_t>(mapRecovered.size()) >= nMaxCacheSize) {
+            // Evict a random entry, same reasoning as the script signature cache
+            std::map<uint256, CKeyID>::iterator it = mapRecovered.lower_bound(GetRandHash());
+            if (it == mapRecovered.end())
+                it = mapRecovered.begin();
+            mapRecovered.erase(it);
+        }
+        mapRecovered[hashEntry] = keyID;
+    }
+
+    void GetStats(uint64_t& nHitsRet, uint64_t& nMissesRet, size_t& nSizeRet) const
+    {
+        LOCK(cs_cache);
+        nHitsRet = nHits;
+        nMissesRet = nMisses;
+        nSizeRet = mapRecovered.size();
+    }
+};
+
+CRecoveredKeyCache recoveredKeyCache;
+
+}
+
 bool CMasternodeSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
-
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
-        errorMessage = _("Error recovering public key.");
-        return false;
+    uint256 hashMessage = ss.GetHash();
+
+    CKeyID keyID;
+    if (!recoveredKeyCache.Get(hashMessage, vchSig, keyID)) {
+        CPubKey pubkey2;
+        if (!pubkey2.RecoverCompact(hashMessage, vchSig)) {
+            errorMessage = _("Error recovering public key.");
+            return false;
+        }
+        keyID = pubkey2.GetID();
+        recoveredKeyCache.Set(hashMessage, vchSig, keyID);
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CMasternodeSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CMasternodeSigner::VerifyMessage -- keys don't match: %s %s\n", keyID.ToString(), pubkey.GetID().ToString());
+
+    return (keyID == pubkey.GetID());
+}
 
-    return (pubkey2.GetID() == pubkey.GetID());
+void CMasternodeSigner::GetSigCacheStats(uint64_t& nHits, uint64_t& nMisses, size_t& nSize) const
+{
+    recoveredKeyCache.GetStats(nHits, nMisses, nSize);
 }
 
 bool CMasternodeSigner::SetCollateralAddress(std::string strAddress)
@@ -11,6 +11,9 @@
 #include "sync.h"
 #include "base58.h"
 
+/** Default for -maxmnsigcachesize, maximum number of cached recovered message signers */
+static const unsigned int DEFAULT_MAX_MN_SIG_CACHE_SIZE = 20000;
+
 /** Helper object for signing and checking signatures
  */
 class CMasternodeSigner
@@ -18,8 +21,6 @@ class CMasternodeSigner
 public:
     CScript collateralPubKey;
 
-    /// Is the inputs associated with this public key? (and there is STAKEC collateral - checking if valid masternode)
-    bool IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey);
     /// Set the private/public key values, returns true if successful
     bool GetKeysFromSecret(std::string strSecret, CKey& keyRet, CPubKey& pubkeyRet);
     /// Set the private/public key values, returns true if successful
@@ -28,6 +29,8 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Hit/miss counters and size of the recovered signer cache used by VerifyMessage
+    void GetSigCacheStats(uint64_t& nHits, uint64_t& nMisses, size_t& nSize) const;
 
     bool SetCollateralAddress(std::string strAddress);
 
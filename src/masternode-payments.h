@@ -55,9 +55,16 @@ public:
         IncorrectFormat
     };
 
+private:
+    /// Read the whole file into the stream and check it, leaving the stream at the data
+    ReadResult ReadFile(CDataStream& ssObj);
+
+public:
     CMasternodePaymentDB();
     bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+    /// Check the header and checksum of the file without loading it
+    ReadResult Verify();
+    ReadResult Read(CMasternodePayments& objToLoad);
 };
 
 class CMasternodePayee
@@ -94,16 +101,20 @@ class CMasternodeBlockPayees
 public:
     int nBlockHeight;
     std::vector<CMasternodePayee> vecPayments;
+    // most votes any payee has, kept up to date by AddPayee
+    int nMaxVotes;
 
     CMasternodeBlockPayees()
     {
         nBlockHeight = 0;
         vecPayments.clear();
+        nMaxVotes = 0;
     }
     CMasternodeBlockPayees(int nBlockHeightIn)
     {
         nBlockHeight = nBlockHeightIn;
         vecPayments.clear();
+        nMaxVotes = 0;
     }
 
     void AddPayee(CScript payeeIn, int nIncrement)
@@ -113,12 +124,14 @@ public:
         BOOST_FOREACH (CMasternodePayee& payee, vecPayments) {
             if (payee.scriptPubKey == payeeIn) {
                 payee.nVotes += nIncrement;
+                nMaxVotes = std::max(nMaxVotes, payee.nVotes);
                 return;
             }
         }
 
         CMasternodePayee c(payeeIn, nIncrement);
         vecPayments.push_back(c);
+        nMaxVotes = std::max(nMaxVotes, nIncrement);
     }
 
     bool GetPayee(CScript& payee)
@@ -157,6 +170,11 @@ public:
     {
         READWRITE(nBlockHeight);
         READWRITE(vecPayments);
+        if (ser_action.ForRead()) {
+            nMaxVotes = 0;
+            BOOST_FOREACH (const CMasternodePayee& payee, vecPayments)
+                nMaxVotes = std::max(nMaxVotes, payee.nVotes);
+        }
     }
 };
 
@@ -242,6 +260,8 @@ public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    // hashes of mapMasternodePayeeVotes by block height, so old votes expire without a full scan
+    std::map<int, std::vector<uint256> > mapPayeeVotesByHeight;
 
     CMasternodePayments()
     {
@@ -254,6 +274,7 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVotesByHeight.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -267,6 +288,21 @@ public:
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
 
+    bool HasPayeeVote(const uint256& hash)
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+        return mapMasternodePayeeVotes.count(hash);
+    }
+
+    /// Has this masternode already voted for this block, doesn't record anything
+    bool HasVoted(const COutPoint& outMasternode, int nBlockHeight)
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+
+        std::map<uint256, int>::const_iterator it = mapMasternodesLastVote.find(outMasternode.hash + outMasternode.n);
+        return it != mapMasternodesLastVote.end() && it->second == nBlockHeight;
+    }
+
     bool CanVote(COutPoint outMasternode, int nBlockHeight)
     {
         LOCK(cs_mapMasternodePayeeVotes);
@@ -297,6 +333,11 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead()) {
+            mapPayeeVotesByHeight.clear();
+            for (std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it)
+                mapPayeeVotesByHeight[it->second.nBlockHeight].push_back(it->first);
+        }
     }
 };
 
@@ -30,7 +30,6 @@ using namespace std;
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -113,6 +112,10 @@ private:
     mutable CCriticalSection cs;
     int64_t lastTimeChecked;
 
+    // the manager keeps its key indexes in sync, see CMasternodeMan::UpdateFromNewBroadcast
+    friend class CMasternodeMan;
+    bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
+
 public:
     enum state {
         MASTERNODE_PRE_ENABLED,
@@ -193,7 +196,9 @@ public:
         return !(a.vin == b.vin);
     }
 
-    uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0) const;
+    // Score of a collateral for a block, hashBlockDigest is Hash(hashBlock) and is the same for every Masternode
+    static uint256 CalculateScore(const COutPoint& collateral, const uint256& hashBlock, const uint256& hashBlockDigest);
 
     ADD_SERIALIZE_METHODS;
 
@@ -220,9 +225,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
-
-    bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
+    int64_t SecondsSincePayment(int nEnabledCount = -1);
 
     inline uint64_t SliceHash(uint256& hash, int slice)
     {
@@ -268,7 +271,7 @@ public:
         return cacheInputAge + (chainActive.Tip()->nHeight - cacheInputAgeBlock);
     }
 
-    std::string GetStatus();
+    std::string GetStatus() const;
 
     std::string Status()
     {
@@ -283,7 +286,7 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    int64_t GetLastPaid(int nEnabledCount = -1);
     bool IsValidNetAddr();
 };
 
@@ -299,8 +302,10 @@ public:
     CMasternodeBroadcast(CService newAddr, CTxIn newVin, CPubKey newPubkey, CPubKey newPubkey2, int protocolVersionIn);
     CMasternodeBroadcast(const CMasternode& mn);
 
-    bool CheckAndUpdate(int& nDoS);
+    bool CheckAndUpdate(int& nDoS, bool fSignatureChecked = false);
     bool CheckInputsAndAdd(int& nDos);
+    // Only the collateral address signature, does not touch any shared state
+    bool VerifySignature() const;
     bool Sign(CKey& keyCollateralAddress);
     void Relay();
 
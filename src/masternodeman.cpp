@@ -11,8 +11,10 @@
 #include "masternode.h"
 #include "spork.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 /** Masternode manager */
 CMasternodeMan mnodeman;
@@ -25,17 +27,9 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+struct CompareScorePtr {
+    bool operator()(const pair<int64_t, CMasternode*>& t1,
+        const pair<int64_t, CMasternode*>& t2) const
     {
         return t1.first < t2.first;
     }
@@ -84,9 +78,8 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     return true;
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
+CMasternodeDB::ReadResult CMasternodeDB::ReadFile(CDataStream& ssMasternodes)
 {
-    int64_t nStart = GetTimeMillis();
     // open input file, and associate with CAutoFile
     FILE* file = fopen(pathMN.string().c_str(), "rb");
     CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
@@ -101,13 +94,12 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
     // Don't try to resize to a negative number if file is small
     if (dataSize < 0)
         dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
+    ssMasternodes.resize(dataSize);
     uint256 hashIn;
 
     // read data and checksum from file
     try {
-        filein.read((char*)&vchData[0], dataSize);
+        filein.read((char*)&ssMasternodes[0], dataSize);
         filein >> hashIn;
     } catch (std::exception& e) {
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -115,8 +107,6 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
     }
     filein.fclose();
 
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
-
     // verify stored checksum matches input data
     uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
     if (hashIn != hashTmp) {
@@ -128,7 +118,6 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
     std::string strMagicMessageTmp;
     try {
         // de-serialize file header (masternode cache file specific magic message) and ..
-
         ssMasternodes >> strMagicMessageTmp;
 
         // ... verify the message matches predefined one
@@ -145,6 +134,30 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
             error("%s : Invalid network magic number", __func__);
             return IncorrectMagicNumber;
         }
+    } catch (std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+
+    return Ok;
+}
+
+CMasternodeDB::ReadResult CMasternodeDB::Verify()
+{
+    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
+    return ReadFile(ssMasternodes);
+}
+
+CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
+{
+    int64_t nStart = GetTimeMillis();
+
+    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
+    ReadResult result = ReadFile(ssMasternodes);
+    if (result != Ok)
+        return result;
+
+    try {
         // de-serialize data into CMasternodeMan object
         ssMasternodes >> mnodemanToLoad;
     } catch (std::exception& e) {
@@ -155,12 +168,6 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
 
     LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrint("masternode","Masternode manager - result:\n");
-        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    }
 
     return Ok;
 }
@@ -170,10 +177,10 @@ void DumpMasternodes()
     int64_t nStart = GetTimeMillis();
 
     CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
 
+    // only the header and checksum are checked, the data itself is ours to overwrite
     LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
+    CMasternodeDB::ReadResult readResult = mndb.Verify();
     // there was an error and it was not an error on file opening => do not proceed
     if (readResult == CMasternodeDB::FileError)
         LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
@@ -194,6 +201,8 @@ void DumpMasternodes()
 
 CMasternodeMan::CMasternodeMan()
 {
+    nSnapshotTime = 0;
+    nListSnapshotId = 0;
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -206,7 +215,13 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        std::list<CMasternode>::iterator it = listMasternodes.insert(listMasternodes.end(), mn);
+        mapMasternodesByCollateral[mn.vin.prevout] = it;
+        IndexKeys(*it);
+        AddCollateral(mn.vin.prevout);
+        mapScoreCache.clear();
+        pMasternodesSnapshot.reset();
+        pListSnapshot.reset();
         return true;
     }
 
@@ -229,11 +244,360 @@ void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
     mWeAskedForMasternodeListEntry[vin.prevout] = askAgain;
 }
 
+void CMasternodeMan::IndexKeys(CMasternode& mn)
+{
+    mapMasternodesByPubKey.insert(std::make_pair(mn.pubKeyMasternode.GetID(), &mn));
+    mapMasternodesByPayee.insert(std::make_pair(mn.pubKeyCollateralAddress.GetID(), &mn));
+}
+
+static void EraseFromIndex(boost::unordered_multimap<CKeyID, CMasternode*, KeyIDHasher>& mapIndex, const CKeyID& keyID, const CMasternode* pmn)
+{
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, KeyIDHasher>::iterator iterator;
+    std::pair<iterator, iterator> range = mapIndex.equal_range(keyID);
+    for (iterator it = range.first; it != range.second; ++it) {
+        if (it->second == pmn) {
+            mapIndex.erase(it);
+            return;
+        }
+    }
+}
+
+void CMasternodeMan::UnindexKeys(CMasternode& mn)
+{
+    EraseFromIndex(mapMasternodesByPubKey, mn.pubKeyMasternode.GetID(), &mn);
+    EraseFromIndex(mapMasternodesByPayee, mn.pubKeyCollateralAddress.GetID(), &mn);
+}
+
+std::list<CMasternode>::iterator CMasternodeMan::Erase(std::list<CMasternode>::iterator it)
+{
+    UnindexKeys(*it);
+    mapMasternodesByCollateral.erase(it->vin.prevout);
+    RemoveCollateral(it->vin.prevout);
+    mapScoreCache.clear();
+    pMasternodesSnapshot.reset();
+    pListSnapshot.reset();
+    return listMasternodes.erase(it);
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    mapMasternodesByCollateral.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByPayee.clear();
+    for (std::list<CMasternode>::iterator it = listMasternodes.begin(); it != listMasternodes.end(); ++it) {
+        mapMasternodesByCollateral[it->vin.prevout] = it;
+        IndexKeys(*it);
+    }
+    RebuildCollateralIndex();
+    mapScoreCache.clear();
+    pMasternodesSnapshot.reset();
+    pListSnapshot.reset();
+}
+
+bool CMasternodeMan::UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+
+    // the broadcast may carry new keys
+    UnindexKeys(*pmn);
+    bool fUpdated = pmn->UpdateFromNewBroadcast(mnb);
+    IndexKeys(*pmn);
+    if (fUpdated) {
+        pMasternodesSnapshot.reset();
+        pListSnapshot.reset();
+    }
+
+    return fUpdated;
+}
+
+boost::shared_ptr<const std::vector<CMasternode> > CMasternodeMan::GetFullMasternodeVector()
+{
+    LOCK(cs);
+
+    if (pMasternodesSnapshot && nSnapshotTime + MASTERNODE_CHECK_SECONDS > GetTime())
+        return pMasternodesSnapshot;
+
+    Check();
+    pMasternodesSnapshot.reset(new std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end()));
+    nSnapshotTime = GetTime();
+
+    return pMasternodesSnapshot;
+}
+
+static void AppendListChunk(CMasternodeListSnapshot& snapshot, std::vector<CMasternodeBroadcast>& vChunk)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vChunk;
+    snapshot.vChunks.push_back(ss);
+    vChunk.clear();
+}
+
+boost::shared_ptr<const CMasternodeListSnapshot> CMasternodeMan::GetListSnapshot()
+{
+    LOCK(cs);
+
+    if (pListSnapshot && pListSnapshot->nTimeBuilt + MASTERNODE_CHECK_SECONDS > GetTime())
+        return pListSnapshot;
+
+    boost::shared_ptr<CMasternodeListSnapshot> pSnapshot(new CMasternodeListSnapshot());
+    pSnapshot->nId = ++nListSnapshotId;
+    pSnapshot->nTimeBuilt = GetTime();
+
+    std::vector<CMasternodeBroadcast> vChunk;
+    vChunk.reserve(MASTERNODES_DSEG_CHUNK);
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        if (mn.addr.IsRFC1918()) continue; //local network
+        if (!mn.IsEnabled()) continue;
+
+        CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+        uint256 hash = mnb.GetHash();
+        pSnapshot->vHashes.push_back(hash);
+
+        // old peers fetch the entries one by one with getdata
+        if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+
+        vChunk.push_back(mnb);
+        if (vChunk.size() >= MASTERNODES_DSEG_CHUNK) AppendListChunk(*pSnapshot, vChunk);
+    }
+    if (!vChunk.empty()) AppendListChunk(*pSnapshot, vChunk);
+
+    LogPrint("masternode", "CMasternodeMan::GetListSnapshot - built list %d, %d entries in %d chunks\n",
+        pSnapshot->nId, pSnapshot->vHashes.size(), pSnapshot->vChunks.size());
+
+    pListSnapshot = pSnapshot;
+    return pListSnapshot;
+}
+
+void CMasternodeMan::AddCollateral(const COutPoint& outpoint)
+{
+    LOCK(cs_collaterals);
+    mapCollaterals.insert(std::make_pair(outpoint, CCollateralSpend()));
+}
+
+void CMasternodeMan::RemoveCollateral(const COutPoint& outpoint)
+{
+    LOCK(cs_collaterals);
+    mapCollaterals.erase(outpoint);
+}
+
+void CMasternodeMan::RebuildCollateralIndex()
+{
+    LOCK(cs_collaterals);
+    mapCollaterals.clear();
+    BOOST_FOREACH (const CMasternode& mn, listMasternodes) {
+        mapCollaterals.insert(std::make_pair(mn.vin.prevout, CCollateralSpend()));
+    }
+}
+
+bool CMasternodeMan::IsCollateralSpent(const COutPoint& outpoint) const
+{
+    LOCK(cs_collaterals);
+    std::map<COutPoint, CCollateralSpend>::const_iterator it = mapCollaterals.find(outpoint);
+    return it != mapCollaterals.end() && it->second.fSpent;
+}
+
+void CMasternodeMan::SyncTransaction(const CTransactionRef& ptx, const CBlock* pblock)
+{
+    // Called for every transaction entering the mempool, connected or disconnected,
+    // usually with cs_main held, so only the collateral index lock is taken here.
+    // Mempool spends are ignored: they may be evicted or lose to a conflicting spend.
+    const CTransaction& tx = *ptx;
+    if (tx.IsCoinBase()) return;
+
+    LOCK(cs_collaterals);
+    if (mapCollaterals.empty()) return;
+
+    uint256 txid = tx.GetHash();
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        std::map<COutPoint, CCollateralSpend>::iterator it = mapCollaterals.find(txin.prevout);
+        if (it == mapCollaterals.end()) continue;
+
+        CCollateralSpend& spend = it->second;
+        if (pblock != NULL && !spend.fSpent) {
+            LogPrint("masternode", "CMasternodeMan::SyncTransaction -- collateral %s spent by %s\n",
+                txin.prevout.ToStringShort(), txid.ToString());
+            spend.fSpent = true;
+            spend.txid = txid;
+        } else if (pblock == NULL && spend.fSpent && spend.txid == txid) {
+            // the block spending it was disconnected
+            LogPrint("masternode", "CMasternodeMan::SyncTransaction -- collateral %s unspent again, %s disconnected\n",
+                txin.prevout.ToStringShort(), txid.ToString());
+            spend = CCollateralSpend();
+        }
+    }
+}
+
+void CMasternodeMan::CheckCollaterals()
+{
+    // Collaterals may have been spent while we were offline, so check the
+    // loaded list against the UTXO set. Spends found this way have no known
+    // transaction to undo on a reorg, so they are checked again periodically.
+    std::vector<COutPoint> vOutpoints;
+    {
+        LOCK(cs_collaterals);
+        for (std::map<COutPoint, CCollateralSpend>::const_iterator it = mapCollaterals.begin(); it != mapCollaterals.end(); ++it) {
+            if (it->second.txid.IsNull()) vOutpoints.push_back(it->first);
+        }
+    }
+
+    std::vector<COutPoint> vSpent;
+    std::vector<COutPoint> vUnspent;
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH (const COutPoint& outpoint, vOutpoints) {
+            const CCoins* coins = pcoinsTip->AccessCoins(outpoint.hash);
+            if (coins == NULL || !coins->IsAvailable(outpoint.n))
+                vSpent.push_back(outpoint);
+            else
+                vUnspent.push_back(outpoint);
+        }
+    }
+
+    LOCK(cs_collaterals);
+    BOOST_FOREACH (const COutPoint& outpoint, vSpent) {
+        std::map<COutPoint, CCollateralSpend>::iterator it = mapCollaterals.find(outpoint);
+        if (it != mapCollaterals.end() && it->second.txid.IsNull()) it->second.fSpent = true;
+    }
+    BOOST_FOREACH (const COutPoint& outpoint, vUnspent) {
+        std::map<COutPoint, CCollateralSpend>::iterator it = mapCollaterals.find(outpoint);
+        if (it != mapCollaterals.end() && it->second.txid.IsNull()) it->second.fSpent = false;
+    }
+    LogPrint("masternode", "CMasternodeMan::CheckCollaterals -- %d of %d collaterals spent\n", vSpent.size(), vOutpoints.size());
+}
+
+// Masternode payments are the outputs of the coinbase, or coinstake for proof of stake,
+// that do not go to the block creator
+static void GetBlockPayees(const CBlock& block, std::vector<CScript>& vPayees)
+{
+    if (block.IsProofOfStake()) {
+        // vout[0] is empty, the stake outputs that follow pay back to the staker
+        const CTransaction& tx = *block.vtx[1];
+        for (unsigned int i = 2; i < tx.vout.size(); i++) {
+            if (tx.vout[i].scriptPubKey != tx.vout[1].scriptPubKey)
+                vPayees.push_back(tx.vout[i].scriptPubKey);
+        }
+    } else if (!block.vtx.empty()) {
+        const CTransaction& tx = *block.vtx[0];
+        for (unsigned int i = 1; i < tx.vout.size(); i++) {
+            vPayees.push_back(tx.vout[i].scriptPubKey);
+        }
+    }
+}
+
+void CMasternodeMan::UpdateLastPaid(const CBlock& block, const CBlockIndex* pindex)
+{
+    std::vector<CScript> vPayees;
+    GetBlockPayees(block, vPayees);
+
+    LOCK(cs_lastpaid);
+    BOOST_FOREACH (const CScript& payee, vPayees) {
+        std::vector<std::pair<int, int64_t> >& vPayments = mapLastPaid[payee].vPayments;
+        if (!vPayments.empty() && vPayments.back().first >= pindex->nHeight) continue;
+
+        vPayments.push_back(std::make_pair(pindex->nHeight, pindex->GetBlockTime()));
+        if (vPayments.size() > MASTERNODES_LAST_PAID_HISTORY)
+            vPayments.erase(vPayments.begin());
+    }
+    hashLastPaidBlock = pindex->GetBlockHash();
+
+    if (pindex->nHeight % 1000 == 0) {
+        std::map<CScript, CMasternodeLastPaid>::iterator it = mapLastPaid.begin();
+        while (it != mapLastPaid.end()) {
+            if (it->second.vPayments.back().first < pindex->nHeight - MASTERNODES_LAST_PAID_DEPTH) {
+                mapLastPaid.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void CMasternodeMan::UndoLastPaid(const CBlock& block, const CBlockIndex* pindex)
+{
+    std::vector<CScript> vPayees;
+    GetBlockPayees(block, vPayees);
+
+    LOCK(cs_lastpaid);
+    BOOST_FOREACH (const CScript& payee, vPayees) {
+        std::map<CScript, CMasternodeLastPaid>::iterator it = mapLastPaid.find(payee);
+        if (it == mapLastPaid.end() || it->second.vPayments.back().first != pindex->nHeight) continue;
+
+        it->second.vPayments.pop_back();
+        if (it->second.vPayments.empty())
+            mapLastPaid.erase(it);
+    }
+    hashLastPaidBlock = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256();
+}
+
+void CMasternodeMan::PruneLastPaid(int nHeight)
+{
+    LOCK(cs_lastpaid);
+    std::map<CScript, CMasternodeLastPaid>::iterator it = mapLastPaid.begin();
+    while (it != mapLastPaid.end()) {
+        std::vector<std::pair<int, int64_t> >& vPayments = it->second.vPayments;
+        while (!vPayments.empty() && vPayments.back().first > nHeight)
+            vPayments.pop_back();
+        if (vPayments.empty() || vPayments.back().first < nHeight - MASTERNODES_LAST_PAID_DEPTH) {
+            mapLastPaid.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void CMasternodeMan::RescanLastPaid()
+{
+    // payments older than the window GetLastPaid searches do not matter
+    int nWindow = std::max((int)(CountEnabled() * 1.25), 1);
+
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+
+    // the index may have been written for blocks that are no longer in the active chain,
+    // or not at all if the cache was missing
+    int nForkHeight = -1;
+    {
+        LOCK(cs_lastpaid);
+        BlockMap::iterator mi = mapBlockIndex.find(hashLastPaidBlock);
+        if (pindexTip != NULL && mi != mapBlockIndex.end() && mi->second != NULL) {
+            const CBlockIndex* pindexFork = chainActive.FindFork(mi->second);
+            if (pindexFork != NULL) nForkHeight = pindexFork->nHeight;
+        }
+        if (nForkHeight < 0) hashLastPaidBlock = uint256();
+    }
+    PruneLastPaid(nForkHeight);
+    if (pindexTip == NULL) return;
+
+    int nStartHeight = std::max(std::max(nForkHeight + 1, pindexTip->nHeight - nWindow + 1), 1);
+    int nScanned = 0;
+    for (CBlockIndex* pindex = chainActive[nStartHeight]; pindex != NULL; pindex = chainActive.Next(pindex)) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex)) {
+            LogPrintf("CMasternodeMan::RescanLastPaid -- failed to read block %s\n", pindex->GetBlockHash().ToString());
+            break;
+        }
+        UpdateLastPaid(block, pindex);
+        nScanned++;
+    }
+    LogPrint("masternode", "CMasternodeMan::RescanLastPaid -- index valid to height %d, scanned %d blocks\n", nForkHeight, nScanned);
+}
+
+bool CMasternodeMan::GetLastPaid(const CScript& payee, int& nHeight, int64_t& nTime) const
+{
+    LOCK(cs_lastpaid);
+    std::map<CScript, CMasternodeLastPaid>::const_iterator it = mapLastPaid.find(payee);
+    if (it == mapLastPaid.end()) return false;
+
+    nHeight = it->second.vPayments.back().first;
+    nTime = it->second.vPayments.back().second;
+    return true;
+}
+
 void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -245,8 +609,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -276,7 +640,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
-            it = vMasternodes.erase(it);
+            it = Erase(it);
         } else {
             ++it;
         }
@@ -337,7 +701,13 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    RebuildIndexes();
+    {
+        LOCK(cs_lastpaid);
+        mapLastPaid.clear();
+        hashLastPaidBlock = uint256();
+    }
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -352,7 +722,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -377,7 +747,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -390,7 +760,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -435,12 +805,17 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    CTxDestination dest;
+    if (!ExtractDestination(payee, dest)) return NULL;
+    const CKeyID* keyID = boost::get<CKeyID>(&dest);
+    if (keyID == NULL) return NULL;
+
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, KeyIDHasher>::const_iterator iterator;
+    std::pair<iterator, iterator> range = mapMasternodesByPayee.equal_range(*keyID);
+    for (iterator it = range.first; it != range.second; ++it) {
+        if (GetScriptForDestination(it->second->pubKeyCollateralAddress.GetID()) == payee)
+            return it->second;
     }
     return NULL;
 }
@@ -449,11 +824,9 @@ CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, CollateralHasher>::iterator it = mapMasternodesByCollateral.find(vin.prevout);
+    if (it == mapMasternodesByCollateral.end()) return NULL;
+    return &*it->second;
 }
 
 
@@ -461,9 +834,11 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, KeyIDHasher>::const_iterator iterator;
+    std::pair<iterator, iterator> range = mapMasternodesByPubKey.equal_range(pubKeyMasternode.GetID());
+    for (iterator it = range.first; it != range.second; ++it) {
+        if (it->second->pubKeyMasternode == pubKeyMasternode)
+            return it->second;
     }
     return NULL;
 }
@@ -483,7 +858,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -499,7 +874,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -546,7 +921,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -564,48 +939,80 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     return NULL;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+static void CalculateScores(std::vector<std::pair<int64_t, CMasternode*> >& vScores, size_t nBegin, size_t nEnd, const uint256& hashBlock, const uint256& hashBlockDigest)
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+    for (size_t i = nBegin; i < nEnd; i++)
+        vScores[i].first = CMasternode::CalculateScore(vScores[i].second->vin.prevout, hashBlock, hashBlockDigest).GetCompact(false);
+}
 
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+CMasternodeScores* CMasternodeMan::GetScores(int64_t nBlockHeight)
+{
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+    if (nBlockHeight == 0) nBlockHeight = chainActive.Tip()->nHeight;
+
+    std::map<int64_t, CMasternodeScores>::iterator it = mapScoreCache.find(nBlockHeight);
+    if (it != mapScoreCache.end() && it->second.hashBlock == hash)
+        return &it->second;
+
+    if (it == mapScoreCache.end() && mapScoreCache.size() >= MASTERNODES_SCORE_CACHE_HEIGHTS)
+        mapScoreCache.erase(mapScoreCache.begin());
+
+    CMasternodeScores& scores = mapScoreCache[nBlockHeight];
+    scores.hashBlock = hash;
+    scores.mapRanks.clear();
+    scores.vScores.clear();
+    scores.vScores.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        scores.vScores.push_back(make_pair((int64_t)0, &mn));
+    }
 
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hash;
+    uint256 hashDigest = ss.GetHash();
+
+    size_t nSize = scores.vScores.size();
+    size_t nThreads = std::min<size_t>(boost::thread::hardware_concurrency(), nSize / MASTERNODES_SCORE_PARALLEL_MIN + 1);
+    if (nThreads > 1) {
+        boost::thread_group threadGroup;
+        size_t nChunk = (nSize + nThreads - 1) / nThreads;
+        for (size_t nBegin = 0; nBegin < nSize; nBegin += nChunk) {
+            threadGroup.create_thread(boost::bind(&CalculateScores, boost::ref(scores.vScores), nBegin,
+                std::min(nBegin + nChunk, nSize), boost::cref(hash), boost::cref(hashDigest)));
         }
+        threadGroup.join_all();
+    } else {
+        CalculateScores(scores.vScores, 0, nSize, hash, hashDigest);
     }
 
-    return winner;
+    sort(scores.vScores.rbegin(), scores.vScores.rend(), CompareScorePtr());
+
+    return &scores;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CMasternodeRanks& CMasternodeMan::GetRanks(CMasternodeScores& scores, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    // enabled state and age change over time, so a table is only trusted as long as a Masternode check
+    CMasternodeRanks& ranks = scores.mapRanks[make_pair(minProtocol, fOnlyActive)];
+    if (ranks.nTimeBuilt + MASTERNODE_CHECK_SECONDS > GetTime())
+        return ranks;
+
     int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
     int64_t nMasternode_Age = 0;
+    bool fFilterAge = IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    ranks.nTimeBuilt = GetTime();
+    ranks.vRanked.clear();
+    ranks.mapRank.clear();
+    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode*) & s, scores.vScores) {
+        CMasternode& mn = *s.second;
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
         }
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        if (fFilterAge) {
             nMasternode_Age = GetAdjustedTime() - mn.sigTime;
             if ((nMasternode_Age) < nMasternode_Min_Age) {
                 if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
@@ -616,57 +1023,77 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        ranks.vRanked.push_back(&mn);
+        ranks.mapRank[mn.vin.prevout] = ranks.vRanked.size();
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    return ranks;
+}
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
+
+    CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return NULL;
+
+    // scores are sorted, so the winner is the first enabled Masternode
+    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode*) & s, pscores->vScores) {
+        if (s.first <= 0) break;
+
+        CMasternode* pmn = s.second;
+        pmn->Check();
+        if (pmn->protocolVersion < minProtocol || !pmn->IsEnabled()) continue;
+
+        return pmn;
     }
 
-    return -1;
+    return NULL;
+}
+
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
+
+    CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return -1;
+
+    const CMasternodeRanks& ranks = GetRanks(*pscores, minProtocol, fOnlyActive);
+    boost::unordered_map<COutPoint, int, CollateralHasher>::const_iterator it = ranks.mapRank.find(vin.prevout);
+    if (it == ranks.mapRank.end()) return -1;
+
+    return it->second;
 }
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
+    LOCK(cs);
+
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    std::vector<CMasternode*> vDisabled;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return vecMasternodeRanks;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
+    // enabled Masternodes by score, followed by the rest
+    int rank = 0;
+    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode*) & s, pscores->vScores) {
+        CMasternode* pmn = s.second;
+        pmn->Check();
 
-        if (mn.protocolVersion < minProtocol) continue;
+        if (pmn->protocolVersion < minProtocol) continue;
 
-        if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+        if (!pmn->IsEnabled()) {
+            vDisabled.push_back(pmn);
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        vecMasternodeRanks.push_back(make_pair(++rank, *pmn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
-        rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+    BOOST_FOREACH (CMasternode* pmn, vDisabled) {
+        vecMasternodeRanks.push_back(make_pair(++rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -674,33 +1101,90 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
+    CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return NULL;
+
+    int rank = 0;
+    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode*) & s, pscores->vScores) {
+        CMasternode* pmn = s.second;
+        if (pmn->protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
+            pmn->Check();
+            if (!pmn->IsEnabled()) continue;
+        }
+
+        rank++;
+        if (rank == nRank) {
+            return pmn;
         }
+    }
+
+    return NULL;
+}
+
+static void VerifyBroadcasts(const std::vector<CPendingBroadcast>& vecBroadcasts, std::vector<char>& vValid, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        vValid[i] = vecBroadcasts[i].mnb.VerifySignature();
+}
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+void CMasternodeMan::ProcessBroadcastQueue()
+{
+    LOCK(cs_process_message);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+    std::vector<CPendingBroadcast> vecBroadcasts;
+    {
+        LOCK(cs_broadcasts);
+        vecBroadcasts.swap(vecPendingBroadcasts);
     }
+    if (vecBroadcasts.empty()) return;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    int64_t nStart = GetTimeMillis();
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
+    // signature recovery is the expensive part and needs nothing but the broadcast itself
+    size_t nSize = vecBroadcasts.size();
+    std::vector<char> vValid(nSize, 0);
+    size_t nThreads = std::min<size_t>(boost::thread::hardware_concurrency(), (nSize + 31) / 32);
+    if (nThreads > 1) {
+        boost::thread_group threadGroup;
+        size_t nChunk = (nSize + nThreads - 1) / nThreads;
+        for (size_t nBegin = 0; nBegin < nSize; nBegin += nChunk) {
+            threadGroup.create_thread(boost::bind(&VerifyBroadcasts, boost::cref(vecBroadcasts), boost::ref(vValid),
+                nBegin, std::min(nBegin + nChunk, nSize)));
         }
+        threadGroup.join_all();
+    } else {
+        VerifyBroadcasts(vecBroadcasts, vValid, 0, nSize);
     }
 
-    return NULL;
+    int nAdded = 0;
+    for (size_t i = 0; i < nSize; i++) {
+        CMasternodeBroadcast& mnb = vecBroadcasts[i].mnb;
+        int nDoS = 0;
+
+        if (!vValid[i]) {
+            LogPrint("masternode","mnb - Got bad Masternode address signature\n");
+            nDoS = 100;
+        } else if (mnb.CheckAndUpdate(nDoS, true)) {
+            if (mnb.CheckInputsAndAdd(nDoS)) {
+                // use this as a peer
+                addrman.Add(CAddress(mnb.addr), vecBroadcasts[i].addrFrom, 2 * 60 * 60);
+                masternodeSync.AddedMasternodeList(mnb.GetHash());
+                nAdded++;
+                continue;
+            }
+            LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
+        }
+
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(vecBroadcasts[i].nodeFrom, nDoS);
+        }
+    }
+
+    LogPrint("masternode", "CMasternodeMan::ProcessBroadcastQueue -- added %d of %d broadcasts  %dms\n", nAdded, nSize, GetTimeMillis() - nStart);
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -718,6 +1202,53 @@ void CMasternodeMan::ProcessMasternodeConnections()
     //}
 }
 
+void CMasternodeMan::ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb)
+{
+    if (mapSeenMasternodeBroadcast.count(mnb.GetHash())) { //seen
+        masternodeSync.AddedMasternodeList(mnb.GetHash());
+        return;
+    }
+    mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+
+    // while syncing the list, new entries are verified in batches
+    if (!masternodeSync.IsMasternodeListSynced() && Find(mnb.vin) == NULL) {
+        CPendingBroadcast pending;
+        pending.mnb = mnb;
+        pending.nodeFrom = pfrom->GetId();
+        pending.addrFrom = pfrom->addr;
+
+        bool fBatchFull;
+        {
+            LOCK(cs_broadcasts);
+            vecPendingBroadcasts.push_back(pending);
+            fBatchFull = vecPendingBroadcasts.size() >= MASTERNODES_BROADCAST_BATCH;
+        }
+        if (fBatchFull) ProcessBroadcastQueue();
+        return;
+    }
+
+    int nDoS = 0;
+    if (!mnb.CheckAndUpdate(nDoS)) {
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+
+        //failed
+        return;
+    }
+
+    // make sure it's still unspent and that the collateral belongs to the signer
+    if (mnb.CheckInputsAndAdd(nDoS)) {
+        // use this as a peer
+        addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
+        masternodeSync.AddedMasternodeList(mnb.GetHash());
+    } else {
+        LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
+
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Masternode related functionality
@@ -729,40 +1260,25 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         CMasternodeBroadcast mnb;
         vRecv >> mnb;
 
-        if (mapSeenMasternodeBroadcast.count(mnb.GetHash())) { //seen
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-            return;
-        }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
-
-        int nDoS = 0;
-        if (!mnb.CheckAndUpdate(nDoS)) {
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessBroadcast(pfrom, mnb);
+    }
 
-            //failed
-            return;
-        }
+    else if (strCommand == "mnblist") { //Masternode list chunk, reply to dseg from peers supporting it
+        int nSnapshot, nChunk, nChunks;
+        std::vector<CMasternodeBroadcast> vMnb;
+        vRecv >> nSnapshot >> nChunk >> nChunks >> vMnb;
 
-        // make sure the vout that was signed is related to the transaction that spawned the Masternode
-        //  - this is expensive, so it's only done once per Masternode
-        if (!masternodeSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
-            LogPrint("masternode","mnb - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 33);
+        if (vMnb.size() > MASTERNODES_DSEG_CHUNK) {
+            LogPrint("masternode", "mnblist - oversized chunk of %d entries from peer %i\n", vMnb.size(), pfrom->GetId());
+            Misbehaving(pfrom->GetId(), 20);
             return;
         }
 
-        // make sure it's still unspent
-        if (mnb.CheckInputsAndAdd(nDoS)) {
-            // use this as a peer
-            addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-        } else {
-            LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
+        LogPrint("masternode", "mnblist - got %d Masternode entries, chunk %d/%d of list %d from peer %i\n",
+            vMnb.size(), nChunk + 1, nChunks, nSnapshot, pfrom->GetId());
 
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-        }
+        BOOST_FOREACH (CMasternodeBroadcast& mnb, vMnb)
+            ProcessBroadcast(pfrom, mnb);
     }
 
     else if (strCommand == "mnp") { //Masternode Ping
@@ -815,34 +1331,36 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             }
         } //else, asking for a specific node which is ok
 
+        if (vin == CTxIn()) {
+            boost::shared_ptr<const CMasternodeListSnapshot> pSnapshot = GetListSnapshot();
+
+            if (pfrom->nVersion >= MNBLIST_VERSION) {
+                // the whole list in a few pre-serialized messages
+                int nChunks = pSnapshot->vChunks.size();
+                for (int i = 0; i < nChunks; i++)
+                    pfrom->PushMessage("mnblist", pSnapshot->nId, i, nChunks, pSnapshot->vChunks[i]);
+            } else {
+                BOOST_FOREACH (const uint256& hash, pSnapshot->vHashes)
+                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
+            }
 
-        int nInvCount = 0;
+            int nCount = pSnapshot->vHashes.size();
+            pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nCount);
+            LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nCount, pfrom->GetId());
+            return;
+        }
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-            if (mn.addr.IsRFC1918()) continue; //local network
+        CMasternode* pmn = Find(vin);
+        if (pmn == NULL || pmn->addr.IsRFC1918() || !pmn->IsEnabled()) return;
 
-            if (mn.IsEnabled()) {
-                LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", mn.vin.prevout.hash.ToString());
-                if (vin == CTxIn() || vin == mn.vin) {
-                    CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
-                    uint256 hash = mnb.GetHash();
-                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
-                    nInvCount++;
+        LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", pmn->vin.prevout.hash.ToString());
+        CMasternodeBroadcast mnb = CMasternodeBroadcast(*pmn);
+        uint256 hash = mnb.GetHash();
+        pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+        if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
 
-                    if (vin == mn.vin) {
-                        LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
-                        return;
-                    }
-                }
-            }
-        }
-
-        if (vin == CTxIn()) {
-            pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
-            LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
-        }
+        LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
     }
 }
 
@@ -850,14 +1368,10 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, CollateralHasher>::iterator it = mapMasternodesByCollateral.find(vin.prevout);
+    if (it != mapMasternodesByCollateral.end()) {
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", vin.prevout.hash.ToString(), size() - 1);
+        Erase(it->second);
     }
 }
 
@@ -875,7 +1389,7 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         if (Add(mn)) {
             masternodeSync.AddedMasternodeList(mnb.GetHash());
         }
-    } else if (pmn->UpdateFromNewBroadcast(mnb)) {
+    } else if (UpdateFromNewBroadcast(pmn, mnb)) {
         masternodeSync.AddedMasternodeList(mnb.GetHash());
     }
 }
@@ -884,7 +1398,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size();
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size();
 
     return info.str();
 }
@@ -13,9 +13,21 @@
 #include "net.h"
 #include "sync.h"
 #include "util.h"
+#include "validationinterface.h"
+
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SCORE_CACHE_HEIGHTS 32
+#define MASTERNODES_SCORE_PARALLEL_MIN 1000
+#define MASTERNODES_LAST_PAID_DEPTH 20000
+#define MASTERNODES_LAST_PAID_HISTORY 10
+#define MASTERNODES_BROADCAST_BATCH 256
+#define MASTERNODES_DSEG_CHUNK 500
 
 using namespace std;
 
@@ -43,12 +55,95 @@ public:
         IncorrectFormat
     };
 
+private:
+    /// Read the whole file into the stream and check it, leaving the stream at the data
+    ReadResult ReadFile(CDataStream& ssObj);
+
+public:
     CMasternodeDB();
     bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    /// Check the header and checksum of the file without loading it
+    ReadResult Verify();
+    ReadResult Read(CMasternodeMan& mnodemanToLoad);
 };
 
-class CMasternodeMan
+/** Recent blocks in the active chain that paid a payee, newest last, so disconnected
+ *  blocks can be undone one at a time
+ */
+class CMasternodeLastPaid
+{
+public:
+    std::vector<std::pair<int, int64_t> > vPayments;
+
+    CMasternodeLastPaid() {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(vPayments);
+    }
+};
+
+struct CollateralHasher {
+    size_t operator()(const COutPoint& outpoint) const { return outpoint.hash.GetLow64() ^ outpoint.n; }
+};
+
+struct KeyIDHasher {
+    size_t operator()(const CKeyID& keyID) const { return keyID.GetLow64(); }
+};
+
+/** Ranks of the Masternodes passing one set of filters for a block height
+ */
+struct CMasternodeRanks {
+    int64_t nTimeBuilt;
+    // best first, the rank of an entry is its position + 1
+    std::vector<CMasternode*> vRanked;
+    boost::unordered_map<COutPoint, int, CollateralHasher> mapRank;
+
+    CMasternodeRanks() : nTimeBuilt(0) {}
+};
+
+/** Scores of the whole Masternode list for a block height
+ */
+struct CMasternodeScores {
+    uint256 hashBlock;
+    // every listed Masternode, best score first
+    std::vector<std::pair<int64_t, CMasternode*> > vScores;
+    // rank tables derived from vScores by (minimum protocol, only active)
+    std::map<std::pair<int, bool>, CMasternodeRanks> mapRanks;
+};
+
+/** Spend of a Masternode collateral in the active chain
+ */
+struct CCollateralSpend {
+    bool fSpent;
+    // block transaction spending it, null if the spend was found in the UTXO set
+    uint256 txid;
+
+    CCollateralSpend() : fSpent(false) {}
+};
+
+/** A Masternode broadcast received during list sync, waiting to be verified with others
+ */
+struct CPendingBroadcast {
+    CMasternodeBroadcast mnb;
+    NodeId nodeFrom;
+    CNetAddr addrFrom;
+};
+
+/** Broadcasts of the enabled Masternodes as served to peers asking for the whole list,
+ *  serialized ahead of time in chunks of up to MASTERNODES_DSEG_CHUNK entries
+ */
+struct CMasternodeListSnapshot {
+    int nId;
+    int64_t nTimeBuilt;
+    std::vector<uint256> vHashes;
+    std::vector<CDataStream> vChunks;
+};
+
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -57,8 +152,12 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs, entries keep their address while others are added and removed
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes by collateral, Masternode key and collateral key (the payee)
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, CollateralHasher> mapMasternodesByCollateral;
+    boost::unordered_multimap<CKeyID, CMasternode*, KeyIDHasher> mapMasternodesByPubKey;
+    boost::unordered_multimap<CKeyID, CMasternode*, KeyIDHasher> mapMasternodesByPayee;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -66,6 +165,58 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // critical section to protect the queue of broadcasts waiting for verification
+    mutable CCriticalSection cs_broadcasts;
+
+    std::vector<CPendingBroadcast> vecPendingBroadcasts;
+
+    // critical section to protect the collateral index, never held while taking another lock
+    mutable CCriticalSection cs_collaterals;
+
+    // collateral outpoint of every listed Masternode, and whether it has been spent in the active chain
+    std::map<COutPoint, CCollateralSpend> mapCollaterals;
+
+    // copy of the list shared by RPC and GUI callers, dropped when the list changes
+    boost::shared_ptr<const std::vector<CMasternode> > pMasternodesSnapshot;
+    int64_t nSnapshotTime;
+
+    // announcements served to dseg requests, dropped when the list changes
+    boost::shared_ptr<const CMasternodeListSnapshot> pListSnapshot;
+    int nListSnapshotId;
+
+    /// Pre-serialized list, shared between dseg replies for up to MASTERNODE_CHECK_SECONDS
+    boost::shared_ptr<const CMasternodeListSnapshot> GetListSnapshot();
+
+    /// Handle a broadcast received alone or as part of a list chunk
+    void ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb);
+
+    // scores by block height, any change to the list clears them
+    std::map<int64_t, CMasternodeScores> mapScoreCache;
+
+    CMasternodeScores* GetScores(int64_t nBlockHeight);
+    const CMasternodeRanks& GetRanks(CMasternodeScores& scores, int minProtocol, bool fOnlyActive);
+
+    // critical section to protect the last paid index, never held while taking another lock
+    mutable CCriticalSection cs_lastpaid;
+
+    // last payment in the active chain by payee script
+    std::map<CScript, CMasternodeLastPaid> mapLastPaid;
+    // tip of the chain mapLastPaid was built against
+    uint256 hashLastPaidBlock;
+
+    void IndexKeys(CMasternode& mn);
+    void UnindexKeys(CMasternode& mn);
+    std::list<CMasternode>::iterator Erase(std::list<CMasternode>::iterator it);
+    void RebuildIndexes();
+
+    void AddCollateral(const COutPoint& outpoint);
+    void RemoveCollateral(const COutPoint& outpoint);
+    void RebuildCollateralIndex();
+
+protected:
+    // CValidationInterface
+    void SyncTransaction(const CTransactionRef& ptx, const CBlock* pblock);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -78,13 +229,26 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
-        READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            std::vector<CMasternode> vMasternodes;
+            READWRITE(vMasternodes);
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+        } else {
+            std::vector<CMasternode> vMasternodes(listMasternodes.begin(), listMasternodes.end());
+            READWRITE(vMasternodes);
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+        {
+            LOCK(cs_lastpaid);
+            READWRITE(mapLastPaid);
+            READWRITE(hashLastPaidBlock);
+        }
     }
 
     CMasternodeMan();
@@ -99,6 +263,30 @@ public:
     /// Check all Masternodes
     void Check();
 
+    /// Verify the queued broadcasts, their signatures in parallel, and add the good ones to the list
+    void ProcessBroadcastQueue();
+
+    /// Re-check collaterals with no known spending transaction against the UTXO set
+    void CheckCollaterals();
+
+    /// Has the collateral of a listed Masternode been spent by a transaction in the active chain
+    bool IsCollateralSpent(const COutPoint& outpoint) const;
+
+    /// Record the payees of a block connected to the active chain
+    void UpdateLastPaid(const CBlock& block, const CBlockIndex* pindex);
+
+    /// Forget the payees of a block disconnected from the active chain
+    void UndoLastPaid(const CBlock& block, const CBlockIndex* pindex);
+
+    /// Drop payments that are not in the active chain up to nHeight or are too old to matter
+    void PruneLastPaid(int nHeight);
+
+    /// Bring the last paid index in line with the active chain after loading it from disk
+    void RescanLastPaid();
+
+    /// Height and time of the last block paying this payee
+    bool GetLastPaid(const CScript& payee, int& nHeight, int64_t& nTime) const;
+
     /// Check all Masternodes and remove inactive
     void CheckAndRemove(bool forceExpiredRemoval = false);
 
@@ -125,11 +313,8 @@ public:
     /// Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod = 1, int64_t nBlockHeight = 0, int minProtocol = 0);
 
-    std::vector<CMasternode> GetFullMasternodeVector()
-    {
-        Check();
-        return vMasternodes;
-    }
+    /// Read-only copy of the list, shared between callers for up to MASTERNODE_CHECK_SECONDS
+    boost::shared_ptr<const std::vector<CMasternode> > GetFullMasternodeVector();
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
     int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
@@ -140,7 +325,7 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -149,6 +334,9 @@ public:
 
     void Remove(CTxIn vin);
 
+    /// Update an entry from a newer broadcast, keeping the indexes in sync
+    bool UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb);
+
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
 };
@@ -30,61 +30,364 @@
 #include "spork.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 //////////////////////////////////////////////////////////////////////////////
 //
 // StakeCenterCashMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
+// The priority part of the block is filled from a heap of mempool entries
+// sorted by coin age priority, ties broken by fee rate.
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second)); // Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
+
+namespace
+{
+/**
+ * Mempool transactions selected for a block on top of hashPrevBlock.
+ * All transactions are checked against view, which is layered on pcoinsTip
+ * and updated with the outputs of every transaction that gets added, so
+ * more transactions can be appended later without checking the earlier
+ * ones again.
+ */
+class CBlockFiller
 {
 public:
-    const CTransaction* ptx;
-    std::set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    CCoinsViewCache view;
+    const uint256 hashPrevBlock;
+    const int nHeight;
+    const unsigned int nBlockMaxSize;
+    const unsigned int nBlockPrioritySize;
+    const unsigned int nBlockMinSize;
+    const int64_t nTimeCreated;
+    const bool fPrintPriority;
+
+    std::vector<CTransactionRef> vtx;
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    //! Transactions are tracked by hash, mempool iterators do not outlive the lock
+    std::set<uint256> inBlock;
+    std::set<uint256> failed;
+    //! Set once a transaction did not fit, a rebuild may then find better ones
+    bool fFull;
+
+    CBlockFiller(const CBlockIndex* pindexPrev, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn)
+        : view(pcoinsTip), hashPrevBlock(pindexPrev->GetBlockHash()), nHeight(pindexPrev->nHeight + 1),
+          nBlockMaxSize(nBlockMaxSizeIn), nBlockPrioritySize(nBlockPrioritySizeIn), nBlockMinSize(nBlockMinSizeIn),
+          nTimeCreated(GetTime()), fPrintPriority(GetBoolArg("-printpriority", false)),
+          nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0), fFull(false) {}
+
+    //! Have all in-mempool parents of iter been added to the block already?
+    bool ParentsInBlock(CTxMemPool::txiter iter) const
+    {
+        BOOST_FOREACH (const CTxMemPool::txiter& parent, mempool.GetMemPoolParents(iter)) {
+            if (!inBlock.count(parent->GetTx().GetHash()))
+                return false;
+        }
+        return true;
+    }
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    //! Check iter against the block limits and consensus rules and add it if it passes
+    bool TryAdd(CTxMemPool::txiter iter, double dPriority)
     {
+        const CTransaction& tx = iter->GetTx();
+        const uint256& hash = tx.GetHash();
+        if (inBlock.count(hash))
+            return true;
+        if (failed.count(hash))
+            return false;
+
+        if (!TestForBlock(iter->GetSharedTx(), iter->GetTxSize())) {
+            failed.insert(hash);
+            return false;
+        }
+
+        inBlock.insert(hash);
+        if (fPrintPriority) {
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), hash.ToString());
+        }
+        return true;
+    }
+
+    //! Add iter together with those of its in-pool ancestors that are not in the block yet, parents first
+    bool TryAddPackage(CTxMemPool::txiter iter)
+    {
+        CTxMemPool::setEntries setAncestors;
+        mempool.CalculateMemPoolAncestors(*iter, setAncestors, false);
+        std::vector<CTxMemPool::txiter> vPackage;
+        BOOST_FOREACH (const CTxMemPool::txiter& ancestor, setAncestors) {
+            if (!inBlock.count(ancestor->GetTx().GetHash()))
+                vPackage.push_back(ancestor);
+        }
+        vPackage.push_back(iter);
+        std::sort(vPackage.begin(), vPackage.end(), CompareByAncestorCount);
+
+        BOOST_FOREACH (const CTxMemPool::txiter& packageIter, vPackage) {
+            if (!TryAdd(packageIter, packageIter->GetPriority(nHeight))) {
+                failed.insert(iter->GetTx().GetHash());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //! Select transactions from the whole mempool
+    void FillFromMempool();
+
+    //! Append transactions that entered the mempool after the selection was made
+    void AddNewTransactions(const std::vector<uint256>& vHashes);
+
+    //! Is every selected transaction still in the mempool?
+    bool AllInMempool() const
+    {
+        BOOST_FOREACH (const CTransactionRef& tx, vtx) {
+            if (!mempool.mapTx.count(tx->GetHash()))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static bool CompareByAncestorCount(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b)
+    {
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+
+    bool TestForBlock(const CTransactionRef& ptx, unsigned int nTxSize)
+    {
+        const CTransaction& tx = *ptx;
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        // Size limits
+        if (nBlockSize + nTxSize >= nBlockMaxSize) {
+            fFull = true;
+            return false;
+        }
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS) {
+            fFull = true;
+            return false;
+        }
+
+        if (!view.HaveInputs(tx))
+            return false;
+
+        CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+
+        nTxSigOps += GetP2SHSigOpCount(tx, view);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS) {
+            fFull = true;
+            return false;
+        }
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+            return false;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, view, txundo, nHeight);
+
+        // Added
+        vtx.push_back(ptx);
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+        return true;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+void CBlockFiller::FillFromMempool()
+{
+    // Fill the priority part of the block by coin age priority. Entries
+    // with in-pool parents wait in waitPriMap until their parents are in.
+    if (nBlockPrioritySize > 0) {
+        std::vector<TxCoinAgePriority> vecPriority;
+        std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy = 0;
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        TxCoinAgePriorityCompare pricomparer;
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+        while (!vecPriority.empty()) {
+            double dPriority = vecPriority.front().first;
+            CTxMemPool::txiter iter = vecPriority.front().second;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+
+            // Stop once past the priority size or out of high-priority transactions
+            if (nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+                break;
+
+            if (!ParentsInBlock(iter)) {
+                waitPriMap.insert(std::make_pair(iter, dPriority));
+                continue;
+            }
+            if (!TryAdd(iter, dPriority))
+                continue;
+
+            // Children that were only waiting for this transaction can go now
+            BOOST_FOREACH (const CTxMemPool::txiter& child, mempool.GetMemPoolChildren(iter)) {
+                std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end() && ParentsInBlock(child)) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+        }
+    }
+
+    // Fill the rest of the block by walking the mempool in order of
+    // package fee rate.
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    for (; mi != mempool.mapTx.get<ancestor_score>().end(); ++mi) {
+        CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+        const uint256& hash = iter->GetTx().GetHash();
+        if (inBlock.count(hash) || failed.count(hash))
+            continue;
+
+        // Skip free transactions if we're past the minimum block size. The
+        // index is sorted, so everything that follows pays too little as well.
+        CFeeRate packageFeeRate(iter->GetModFeesWithAncestors(), iter->GetSizeWithAncestors());
+        if (packageFeeRate < ::minRelayTxFee && nBlockSize >= nBlockMinSize)
+            break;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+        TryAddPackage(iter);
+    }
+}
+
+void CBlockFiller::AddNewTransactions(const std::vector<uint256>& vHashes)
+{
+    BOOST_FOREACH (const uint256& hash, vHashes) {
+        CTxMemPool::txiter iter = mempool.mapTx.find(hash);
+        if (iter == mempool.mapTx.end() || inBlock.count(hash) || failed.count(hash))
+            continue;
+
+        // Late arrivals only get in by fee rate, the priority part is not revisited
+        CFeeRate packageFeeRate(iter->GetModFeesWithAncestors(), iter->GetSizeWithAncestors());
+        if (packageFeeRate < ::minRelayTxFee && nBlockSize >= nBlockMinSize)
+            continue;
+
+        TryAddPackage(iter);
+    }
+}
+
+/**
+ * Keeps the transaction selection of the last block template so that
+ * repeated calls to CreateNewBlock on the same tip, as the stake minter
+ * makes for every kernel search, only have to check the transactions that
+ * entered the mempool since. The selection is made again from scratch when
+ * the tip moves, a selected transaction leaves the mempool or the mempool
+ * changed in any way other than by the additions we were told about.
+ */
+class CBlockTemplateCache : public CValidationInterface
 {
-    bool byFee;
+private:
+    //! Rebuild a full block at most this often to let better paying transactions in
+    static const int64_t FULL_REBUILD_INTERVAL = 30;
+    //! Rebuild instead of queueing more additions than this
+    static const unsigned int MAX_PENDING = 10000;
+
+    CCriticalSection cs_pending;
+    std::vector<uint256> vPending; //! transactions accepted to the mempool since the last update
+    bool fOverflow;
+
+    // Guarded by cs_main and mempool.cs
+    std::unique_ptr<CBlockFiller> pfiller;
+    unsigned int nTransactionsUpdatedLast;
+    bool fRegistered;
+
+protected:
+    void SyncTransaction(const CTransactionRef& ptx, const CBlock* pblock)
+    {
+        if (pblock)
+            return;
+        LOCK(cs_pending);
+        if (vPending.size() >= MAX_PENDING)
+            fOverflow = true;
+        else
+            vPending.push_back(ptx->GetHash());
+    }
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    CBlockTemplateCache() : fOverflow(false), nTransactionsUpdatedLast(0), fRegistered(false) {}
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    const CBlockFiller& Get(const CBlockIndex* pindexPrev, unsigned int nBlockMaxSize, unsigned int nBlockPrioritySize, unsigned int nBlockMinSize)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+        AssertLockHeld(cs_main);
+        AssertLockHeld(mempool.cs);
+        if (!fRegistered) {
+            RegisterValidationInterface(this);
+            fRegistered = true;
         }
+
+        std::vector<uint256> vNew;
+        bool fRebuild;
+        {
+            LOCK(cs_pending);
+            vNew.swap(vPending);
+            fRebuild = fOverflow;
+            fOverflow = false;
+        }
+
+        // Every addition and removal bumps the counter once, so if it moved
+        // by exactly the number of queued additions nothing else happened.
+        unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        if (!pfiller || pfiller->hashPrevBlock != pindexPrev->GetBlockHash() ||
+            pfiller->nBlockMaxSize != nBlockMaxSize || pfiller->nBlockPrioritySize != nBlockPrioritySize ||
+            pfiller->nBlockMinSize != nBlockMinSize)
+            fRebuild = true;
+        else if (nTransactionsUpdated - nTransactionsUpdatedLast != vNew.size() || !pfiller->AllInMempool())
+            fRebuild = true;
+        else if (pfiller->fFull && !vNew.empty() && GetTime() - pfiller->nTimeCreated >= FULL_REBUILD_INTERVAL)
+            fRebuild = true;
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+
+        if (fRebuild) {
+            pfiller.reset(new CBlockFiller(pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize));
+            pfiller->FillFromMempool();
+        } else if (!vNew.empty()) {
+            pfiller->AddNewTransactions(vNew);
+        }
+        return *pfiller;
     }
 };
 
+CBlockTemplateCache blockTemplateCache;
+} // anon namespace
+
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
@@ -131,15 +434,38 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     CBlockIndex* prev = chainActive.Tip();
     txNew.vout[0].nValue = GetBlockValue(prev->nHeight+1);
 
-    pblock->vtx.push_back(txNew);
+    pblock->vtx.emplace_back(); // coinbase, filled in at the end
     pblocktemplate->vTxFees.push_back(-1);   // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
+    // Largest block you're willing to create:
+    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
     // ppcoin: if coinstake available add coinstake tx
     static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // only initialized at startup
 
     if (fProofOfStake) {
         boost::this_thread::interruption_point();
+
+        // Bring the cached transaction selection up to date before searching
+        // for a kernel, so a found stake does not wait on script checks
+        {
+            LOCK2(cs_main, mempool.cs);
+            blockTemplateCache.Get(chainActive.Tip(), nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        }
+
         pblock->nTime = GetAdjustedTime();
         CBlockIndex* pindexPrev = chainActive.Tip();
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
@@ -150,8 +476,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             unsigned int nTxNewTime = 0;
             if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime - nLastCoinStakeSearchTime, txCoinStake, nTxNewTime)) {
                 pblock->nTime = nTxNewTime;
-                pblock->vtx[0].vout[0].SetEmpty();
-                pblock->vtx.push_back(CTransaction(txCoinStake));
+                txNew.vout[0].SetEmpty();
+                pblock->vtx.push_back(MakeTransactionRef(txCoinStake));
                 fStakeFound = true;
             }
             nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
@@ -162,202 +488,18 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             return NULL;
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
-    CAmount nFees = 0;
-
     {
         LOCK2(cs_main, mempool.cs);
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        std::list<COrphan> vOrphan; // list memory doesn't move
-        std::map<uint256, std::vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        std::vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (std::map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
 
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
-
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        std::vector<CBigNum> vBlockSerials;
-        std::vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum& bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                for (COrphan* porphan : mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        const CBlockFiller& filler = blockTemplateCache.Get(pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        pblock->vtx.insert(pblock->vtx.end(), filler.vtx.begin(), filler.vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), filler.vTxFees.begin(), filler.vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), filler.vTxSigOps.begin(), filler.vTxSigOps.end());
+        CAmount nFees = filler.nFees;
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -369,16 +511,16 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             }
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+        nLastBlockTx = filler.nBlockTx;
+        nLastBlockSize = filler.nBlockSize;
         //LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 
         // Compute final coinbase transaction.
-        pblock->vtx[0].vin[0].scriptSig = CScript() << nHeight << OP_0;
-        if (!fProofOfStake) {
-            pblock->vtx[0] = txNew;
+        if (fProofOfStake)
+            txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        else
             pblocktemplate->vTxFees[0] = -nFees;
-        }
+        pblock->vtx[0] = MakeTransactionRef(txNew);
 
         // Fill in header
         pblock->hashPrevBlock = pindexPrev->GetBlockHash();
@@ -386,7 +528,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             UpdateTime(pblock, pindexPrev);
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
         pblock->nNonce = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(*pblock->vtx[0]);
 
         // CValidationState state;
         // if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
@@ -409,11 +551,11 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight + 1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
+    pblock->vtx[0] = MakeTransactionRef(txCoinbase);
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
@@ -438,7 +580,7 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet* pwallet,
 bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
+    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0]->vout[0].nValue));
 
     // Found a solution
     {
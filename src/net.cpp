@@ -21,6 +21,7 @@
 #include "ui_interface.h"
 
 #ifdef WIN32
+#include <math.h>
 #include <string.h>
 #else
 #include <fcntl.h>
@@ -85,7 +86,7 @@ bool fAddressesInitialized = false;
 
 std::vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-std::map<CInv, CDataStream> mapRelay;
+std::map<CInv, CTransactionRef> mapRelay;
 std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -339,6 +340,14 @@ uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
+CCriticalSection CNode::cs_totalMsgStats;
+mapMsgCmdStats CNode::mapTotalMsgStats;
+
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+
 CNode* FindNode(const CNetAddr& ip)
 {
     LOCK(cs_vNodes);
@@ -485,6 +494,7 @@ void CNode::PushVersion()
 
 
 banmap_t CNode::setBanned;
+CSubNetTrie<int64_t> CNode::trieBanned;
 CCriticalSection CNode::cs_setBanned;
 bool CNode::setBannedIsDirty;
 
@@ -493,27 +503,26 @@ void CNode::ClearBanned()
     {
         LOCK(cs_setBanned);
         setBanned.clear();
+        trieBanned.clear();
         setBannedIsDirty = true;
     }
     DumpBanlist(); // store banlist to Disk
     uiInterface.BannedListChanged();
 }
 
-bool CNode::IsBanned(CNetAddr ip)
+namespace
 {
-    bool fResult = false;
-    {
-        LOCK(cs_setBanned);
-        for (banmap_t::iterator it = setBanned.begin(); it != setBanned.end(); it++)
-        {
-            CSubNet subNet = (*it).first;
-            CBanEntry banEntry = (*it).second;
+struct BanActiveAt {
+    int64_t nNow;
+    explicit BanActiveAt(int64_t nNowIn) : nNow(nNowIn) {}
+    bool operator()(int64_t nBanUntil) const { return nNow < nBanUntil; }
+};
+} // anon namespace
 
-            if(subNet.Match(ip) && GetTime() < banEntry.nBanUntil)
-                fResult = true;
-        }
-    }
-    return fResult;
+bool CNode::IsBanned(CNetAddr ip)
+{
+    LOCK(cs_setBanned);
+    return trieBanned.MatchAny(ip, BanActiveAt(GetTime()));
 }
 
 bool CNode::IsBanned(CSubNet subnet)
@@ -552,6 +561,7 @@ void CNode::Ban(const CSubNet& subNet, const BanReason &banReason, int64_t banti
         LOCK(cs_setBanned);
         if (setBanned[subNet].nBanUntil < banEntry.nBanUntil) {
             setBanned[subNet] = banEntry;
+            trieBanned.insert(subNet, banEntry.nBanUntil);
             setBannedIsDirty = true;
         }
         else
@@ -581,6 +591,7 @@ bool CNode::Unban(const CSubNet &subNet)
         LOCK(cs_setBanned);
         if (!setBanned.erase(subNet))
             return false;
+        trieBanned.erase(subNet);
         setBannedIsDirty = true;
     }
     uiInterface.BannedListChanged();
@@ -598,6 +609,9 @@ void CNode::SetBanned(const banmap_t &banMap)
 {
     LOCK(cs_setBanned);
     setBanned = banMap;
+    trieBanned.clear();
+    for (banmap_t::const_iterator it = setBanned.begin(); it != setBanned.end(); ++it)
+        trieBanned.insert(it->first, it->second.nBanUntil);
     setBannedIsDirty = true;
 }
 
@@ -615,6 +629,7 @@ void CNode::SweepBanned()
             CBanEntry banEntry = (*it).second;
             if(now > banEntry.nBanUntil)
             {
+                trieBanned.erase(subNet);
                 setBanned.erase(it++);
                 setBannedIsDirty = true;
                 notifyUI = true;
@@ -643,23 +658,19 @@ void CNode::SetBannedSetDirty(bool dirty)
 }
 
 
-std::vector<CSubNet> CNode::vWhitelistedRange;
+CSubNetTrie<bool> CNode::trieWhitelistedRange;
 CCriticalSection CNode::cs_vWhitelistedRange;
 
 bool CNode::IsWhitelistedRange(const CNetAddr& addr)
 {
     LOCK(cs_vWhitelistedRange);
-    for (const CSubNet& subnet : vWhitelistedRange) {
-        if (subnet.Match(addr))
-            return true;
-    }
-    return false;
+    return trieWhitelistedRange.Match(addr);
 }
 
 void CNode::AddWhitelistedRange(const CSubNet& subnet)
 {
     LOCK(cs_vWhitelistedRange);
-    vWhitelistedRange.push_back(subnet);
+    trieWhitelistedRange.insert(subnet, true);
 }
 
 #undef X
@@ -680,6 +691,10 @@ void CNode::copyStats(CNodeStats& stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    {
+        LOCK(cs_msgStats);
+        X(mapMsgStats);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -732,6 +747,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            RecordMsgRecv(msg.hdr.GetCommand(), msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE);
             messageHandlerCondition.notify_one();
         }
     }
@@ -1840,14 +1856,12 @@ void CExplicitNetCleanup::callCleanup()
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(MakeTransactionRef(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     CInv inv(MSG_TX, tx.GetHash());
     {
         LOCK(cs_mapRelay);
@@ -1857,8 +1871,8 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Keep a reference rather than a serialized copy; the transaction is immutable
+        mapRelay.insert(std::make_pair(inv, ptx));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1899,6 +1913,11 @@ void RelayInv(CInv& inv)
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -1909,6 +1928,148 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now) {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+
+    // whitelisted peers are exempted where historical blocks are served, not here
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    uint64_t recommendedMinimum = (nMaxOutboundTimeframe / Params().TargetSpacing()) * MAX_BLOCK_SIZE;
+    nMaxOutboundLimit = limit;
+
+    if (limit > 0 && limit < recommendedMinimum)
+        LogPrintf("Max outbound target is very small (%s bytes) and will be overshot. Recommended minimum is %s bytes.\n", nMaxOutboundLimit, recommendedMinimum);
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - GetTime();
+}
+
+void CNode::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe) {
+        // reset measure-cycle in case of changing
+        // the timeframe
+        nMaxOutboundCycleStartTime = GetTime();
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit) {
+        // keep a large enough buffer to at least relay each block once
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / Params().TargetSpacing() * MAX_BLOCK_SIZE;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+//! Counters for strCommand, or for NET_MESSAGE_COMMAND_OTHER if it is not a known message type
+static CNetMsgCmdStats& GetMsgCmdStats(mapMsgCmdStats& mapStats, const std::string& strCommand)
+{
+    if (mapStats.empty()) {
+        for (const std::string& strType : getAllNetMessageTypes())
+            mapStats[strType];
+        mapStats[NET_MESSAGE_COMMAND_OTHER];
+    }
+    mapMsgCmdStats::iterator it = mapStats.find(strCommand);
+    if (it == mapStats.end())
+        it = mapStats.find(NET_MESSAGE_COMMAND_OTHER);
+    return it->second;
+}
+
+void CNode::RecordMsgSent(const std::string& strCommand, uint64_t bytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CNetMsgCmdStats& stats = GetMsgCmdStats(mapMsgStats, strCommand);
+        stats.nMsgsSent++;
+        stats.nBytesSent += bytes;
+    }
+    LOCK(cs_totalMsgStats);
+    CNetMsgCmdStats& stats = GetMsgCmdStats(mapTotalMsgStats, strCommand);
+    stats.nMsgsSent++;
+    stats.nBytesSent += bytes;
+}
+
+void CNode::RecordMsgRecv(const std::string& strCommand, uint64_t bytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CNetMsgCmdStats& stats = GetMsgCmdStats(mapMsgStats, strCommand);
+        stats.nMsgsRecv++;
+        stats.nBytesRecv += bytes;
+    }
+    LOCK(cs_totalMsgStats);
+    CNetMsgCmdStats& stats = GetMsgCmdStats(mapTotalMsgStats, strCommand);
+    stats.nMsgsRecv++;
+    stats.nBytesRecv += bytes;
+}
+
+void CNode::RecordMsgProcessTime(const std::string& strCommand, int64_t nMicros)
+{
+    {
+        LOCK(cs_msgStats);
+        GetMsgCmdStats(mapMsgStats, strCommand).nProcessTimeMicros += nMicros;
+    }
+    LOCK(cs_totalMsgStats);
+    GetMsgCmdStats(mapTotalMsgStats, strCommand).nProcessTimeMicros += nMicros;
+}
+
+void CNode::GetTotalMsgStats(mapMsgCmdStats& stats)
+{
+    LOCK(cs_totalMsgStats);
+    stats = mapTotalMsgStats;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -2054,7 +2215,7 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(50000, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2083,7 +2244,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
+    nNextInvSend = 0;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2196,6 +2357,9 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
+    const char* pchCommand = &ssSend[MESSAGE_START_SIZE];
+    RecordMsgSent(std::string(pchCommand, strnlen_int(pchCommand, CMessageHeader::COMMAND_SIZE)), ssSend.size());
+
     std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
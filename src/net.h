@@ -14,9 +14,11 @@
 #include "limitedmap.h"
 #include "mruset.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
+#include "subnettrie.h"
 #include "sync.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
@@ -47,10 +49,20 @@ static const int PING_INTERVAL = 2 * 60;
 static const int TIMEOUT_INTERVAL = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Average delay between trickled inventory transmissions in seconds.
+ *  Blocks and whitelisted receivers bypass this, outbound peers get half this delay. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of tx inventory items to send per transmission.
+ *  Limits the impact of low-fee transaction floods. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** The default for -maxuploadtarget. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The default timeframe for -maxuploadtarget. 1 day. */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** -upnp default */
@@ -136,7 +148,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CTransactionRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -155,6 +167,24 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Message type under which all commands not in getAllNetMessageTypes() are accounted */
+static const char* const NET_MESSAGE_COMMAND_OTHER = "*other*";
+
+/** Traffic and processing time counters for one message type */
+class CNetMsgCmdStats
+{
+public:
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    int64_t nProcessTimeMicros; //! Time spent in ProcessMessage() for received messages
+
+    CNetMsgCmdStats() : nMsgsSent(0), nBytesSent(0), nMsgsRecv(0), nBytesRecv(0), nProcessTimeMicros(0) {}
+};
+
+typedef std::map<std::string, CNetMsgCmdStats> mapMsgCmdStats;
+
 class CNodeStats
 {
 public:
@@ -175,6 +205,7 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    mapMsgCmdStats mapMsgStats;
 };
 
 
@@ -337,6 +368,8 @@ protected:
     // Denial-of-service detection/prevention
     // Key is IP address, value is banned-until-time
     static banmap_t setBanned;
+    // Prefix index of setBanned (subnet -> nBanUntil), protected by cs_setBanned
+    static CSubNetTrie<int64_t> trieBanned;
     static CCriticalSection cs_setBanned;
     static bool setBannedIsDirty;
 
@@ -344,7 +377,7 @@ protected:
 
     // Whitelisted ranges. Any node connecting from these is automatically
     // whitelisted (as well as those connecting to whitelisted binds).
-    static std::vector<CSubNet> vWhitelistedRange;
+    static CSubNetTrie<bool> trieWhitelistedRange;
     static CCriticalSection cs_vWhitelistedRange;
 
     // Basic fuzz-testing
@@ -361,9 +394,15 @@ public:
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
+    // Set of transaction ids we still have to announce.
+    // They are sorted by fee rate before being sent out.
+    std::set<uint256> setInventoryTxToSend;
+    // Non-transaction inventory (blocks, masternode and budget messages),
+    // announced in a single batch on the next SendMessages pass.
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    int64_t nNextInvSend;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
 
@@ -387,6 +426,18 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Per message type counters, for this node and for all nodes
+    CCriticalSection cs_msgStats;
+    mapMsgCmdStats mapMsgStats;
+    static CCriticalSection cs_totalMsgStats;
+    static mapMsgCmdStats mapTotalMsgStats;
+
+    // outbound limit & stats
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -454,20 +505,31 @@ public:
     }
 
 
+    // Transactions are known by their hash. Other inventory is keyed by type as well, a
+    // txlock request shares its transaction's hash and must not hide the transaction inv.
+    static uint256 GetInventoryKnownKey(const CInv& inv)
+    {
+        if (inv.type == MSG_TX)
+            return inv.hash;
+        return Hash(BEGIN(inv.type), END(inv.type), BEGIN(inv.hash), END(inv.hash));
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(GetInventoryKnownKey(inv));
         }
     }
 
     void PushInventory(const CInv& inv)
     {
-        {
-            LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+        LOCK(cs_inventory);
+        if (inv.type == MSG_TX) {
+            if (!filterInventoryKnown.contains(inv.hash))
+                setInventoryTxToSend.insert(inv.hash);
+        } else {
+            vInventoryToSend.push_back(inv);
         }
     }
 
@@ -726,6 +788,33 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // Per message type stats
+    void RecordMsgSent(const std::string& strCommand, uint64_t bytes);
+    void RecordMsgRecv(const std::string& strCommand, uint64_t bytes);
+    void RecordMsgProcessTime(const std::string& strCommand, int64_t nMicros);
+    static void GetTotalMsgStats(mapMsgCmdStats& stats);
+
+    //! set the max outbound target in bytes
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //! set the timeframe for the max outbound target
+    static void SetMaxOutboundTimeframe(uint64_t timeframe);
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! check if the outbound target is reached
+    // if param historicalBlockServingLimit is set true, the function will
+    // response true if the limit for serving historical blocks has been reached
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //! response the bytes left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! response the time in second left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 class CExplicitNetCleanup
@@ -734,12 +823,14 @@ public:
     static void callCleanup();
 };
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
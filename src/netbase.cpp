@@ -1340,6 +1340,17 @@ bool CSubNet::IsValid() const
     return valid;
 }
 
+int CSubNet::GetPrefixLength() const
+{
+    int nBits = 0;
+    while (nBits < 128 && (netmask[nBits >> 3] & (1 << (7 - (nBits & 7)))))
+        ++nBits;
+    for (int n = nBits; n < 128; ++n)
+        if (netmask[n >> 3] & (1 << (7 - (n & 7))))
+            return -1;
+    return nBits;
+}
+
 bool operator==(const CSubNet& a, const CSubNet& b)
 {
     return a.valid == b.valid && a.network == b.network && !memcmp(a.netmask, b.netmask, 16);
@@ -13,6 +13,7 @@
 #include "uint256.h"
 
 #include <list>
+#include <memory>
 
 class CTransaction;
 
@@ -318,4 +319,13 @@ struct CMutableTransaction
 
 };
 
+/**
+ * Shared handle to an immutable transaction. Blocks, the mempool and relay
+ * hold the same instance instead of each keeping its own copy.
+ */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx>
+static inline CTransactionRef MakeTransactionRef(const Tx& txIn) { return std::make_shared<const CTransaction>(txIn); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
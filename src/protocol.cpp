@@ -32,6 +32,22 @@ static const char* ppszTypeName[] =
         "mn announce",
         "mn ping"};
 
+/** All known message types, sent or received. */
+static const char* ppszNetMessageTypes[] = {
+    "version", "verack", "addr", "inv", "getdata", "merkleblock", "getblocks",
+    "getheaders", "tx", "headers", "block", "getaddr", "mempool", "ping",
+    "pong", "alert", "notfound", "filterload", "filteradd", "filterclear",
+    "reject",
+    // masternode, budget, spork and SwiftX messages
+    "mnb", "mnblist", "mnp", "mnw", "mnget", "mnvs", "dseg", "ssc", "mprop", "mvote",
+    "fbs", "fbvote", "spork", "getsporks", "ix", "txlvote"};
+static const std::vector<std::string> allNetMessageTypesVec(ppszNetMessageTypes, ppszNetMessageTypes + ARRAYLEN(ppszNetMessageTypes));
+
+const std::vector<std::string>& getAllNetMessageTypes()
+{
+    return allNetMessageTypesVec;
+}
+
 CMessageHeader::CMessageHeader()
 {
     memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
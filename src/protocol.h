@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -63,6 +64,9 @@ public:
     unsigned int nChecksum;
 };
 
+/** Get a vector of all message types known to this node, used for per message type accounting */
+const std::vector<std::string>& getAllNetMessageTypes();
+
 /** nServices flags */
 enum {
     NODE_NETWORK = (1 << 0),
@@ -100,6 +100,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"getrawmempool", 0},
         {"estimatefee", 0},
         {"estimatepriority", 0},
+        {"estimatesmartfee", 0},
         {"prioritisetransaction", 1},
         {"prioritisetransaction", 2},
         {"setban", 2},
@@ -8,6 +8,7 @@
 #include "init.h"
 #include "main.h"
 #include "masternode-budget.h"
+#include "masternode-helpers.h"
 #include "masternode-payments.h"
 #include "masternodeconfig.h"
 #include "masternodeman.h"
@@ -314,7 +315,15 @@ UniValue getmasternodecount (const UniValue& params, bool fHelp)
             "  \"stable\": n,       (numeric) Stable count\n"
             "  \"compat\": n,       (numeric) Compatible\n"
             "  \"enabled\": n,      (numeric) Enabled masternodes\n"
-            "  \"inqueue\": n       (numeric) Masternodes in queue\n"
+            "  \"inqueue\": n,      (numeric) Masternodes in queue\n"
+            "  \"ipv4\": n,         (numeric) Number of IPv4 masternodes\n"
+            "  \"ipv6\": n,         (numeric) Number of IPv6 masternodes\n"
+            "  \"onion\": n,        (numeric) Number of Tor masternodes\n"
+            "  \"sigcache\": {      (json object) Recovered message signer cache\n"
+            "    \"hits\": n,       (numeric) Signatures verified from the cache\n"
+            "    \"misses\": n,     (numeric) Signatures that needed key recovery\n"
+            "    \"size\": n        (numeric) Current number of cache entries\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -338,6 +347,15 @@ UniValue getmasternodecount (const UniValue& params, bool fHelp)
     obj.push_back(Pair("ipv6", ipv6));
     obj.push_back(Pair("onion", onion));
 
+    uint64_t nSigCacheHits = 0, nSigCacheMisses = 0;
+    size_t nSigCacheSize = 0;
+    masternodeSigner.GetSigCacheStats(nSigCacheHits, nSigCacheMisses, nSigCacheSize);
+    UniValue sigCache(UniValue::VOBJ);
+    sigCache.push_back(Pair("hits", nSigCacheHits));
+    sigCache.push_back(Pair("misses", nSigCacheMisses));
+    sigCache.push_back(Pair("size", (uint64_t)nSigCacheSize));
+    obj.push_back(Pair("sigcache", sigCache));
+
     return obj;
 }
 
@@ -852,12 +870,17 @@ UniValue getmasternodescores (const UniValue& params, bool fHelp)
     }
     UniValue obj(UniValue::VOBJ);
 
-    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+    boost::shared_ptr<const std::vector<CMasternode> > pMasternodes = mnodeman.GetFullMasternodeVector();
     for (int nHeight = chainActive.Tip()->nHeight - nLast; nHeight < chainActive.Tip()->nHeight + 20; nHeight++) {
         uint256 nHigh = 0;
-        CMasternode* pBestMasternode = NULL;
-        for (CMasternode& mn : vMasternodes) {
-            uint256 n = mn.CalculateScore(1, nHeight - 100);
+        const CMasternode* pBestMasternode = NULL;
+        uint256 hashBlock = 0;
+        if (!GetBlockHash(hashBlock, nHeight - 100)) continue;
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << hashBlock;
+        uint256 hashBlockDigest = ss.GetHash();
+        for (const CMasternode& mn : *pMasternodes) {
+            uint256 n = CMasternode::CalculateScore(mn.vin.prevout, hashBlock, hashBlockDigest);
             if (n > nHigh) {
                 nHigh = n;
                 pBestMasternode = &mn;
@@ -57,6 +57,24 @@ UniValue ping(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+static UniValue MsgCmdStatsToJSON(const mapMsgCmdStats& mapStats)
+{
+    UniValue ret(UniValue::VOBJ);
+    for (const std::pair<const std::string, CNetMsgCmdStats>& item : mapStats) {
+        const CNetMsgCmdStats& stats = item.second;
+        if (stats.nMsgsSent == 0 && stats.nMsgsRecv == 0)
+            continue;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("msgssent", stats.nMsgsSent));
+        obj.push_back(Pair("bytessent", stats.nBytesSent));
+        obj.push_back(Pair("msgsrecv", stats.nMsgsRecv));
+        obj.push_back(Pair("bytesrecv", stats.nBytesRecv));
+        obj.push_back(Pair("processtime", stats.nProcessTimeMicros));
+        ret.push_back(Pair(item.first, obj));
+    }
+    return ret;
+}
+
 static void CopyNodeStats(std::vector<CNodeStats>& vstats)
 {
     vstats.clear();
@@ -100,7 +118,17 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"msgstats\": {              (json object) Traffic per message type, only types seen on this connection\n"
+            "      \"type\": {               (json object) Message type, \"*other*\" for unknown types\n"
+            "        \"msgssent\": n,        (numeric) Number of messages sent\n"
+            "        \"bytessent\": n,       (numeric) Bytes sent, including message headers\n"
+            "        \"msgsrecv\": n,        (numeric) Number of messages received\n"
+            "        \"bytesrecv\": n,       (numeric) Bytes received, including message headers\n"
+            "        \"processtime\": n      (numeric) Microseconds spent processing received messages\n"
+            "      }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -147,6 +175,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("msgstats", MsgCmdStatsToJSON(stats.mapMsgStats)));
 
         ret.push_back(obj);
     }
@@ -334,7 +363,16 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\":\n"
+            "  {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -343,9 +381,43 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
 
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetmsgstats\n"
+            "\nReturns traffic and processing time per message type, summed over all connections\n"
+            "since startup. Message types that were never sent or received are omitted.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"type\": {             (json object) Message type, \"*other*\" for unknown types\n"
+            "    \"msgssent\": n,      (numeric) Number of messages sent\n"
+            "    \"bytessent\": n,     (numeric) Bytes sent, including message headers\n"
+            "    \"msgsrecv\": n,      (numeric) Number of messages received\n"
+            "    \"bytesrecv\": n,     (numeric) Bytes received, including message headers\n"
+            "    \"processtime\": n    (numeric) Microseconds spent processing received messages\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgstats", "") + HelpExampleRpc("getnetmsgstats", ""));
+
+    mapMsgCmdStats mapStats;
+    CNode::GetTotalMsgStats(mapStats);
+    return MsgCmdStatsToJSON(mapStats);
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -12,6 +12,7 @@
 #include "eccryptoverify.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -987,6 +988,46 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
 namespace {
 
+/** Serialize scriptCode as it appears in a signature hash, skipping OP_CODESEPARATORs */
+template<typename S>
+void SerializeScriptCode(S &s, const CScript& scriptCode) {
+    CScript::const_iterator it = scriptCode.begin();
+    CScript::const_iterator itBegin = it;
+    opcodetype opcode;
+    unsigned int nCodeSeparators = 0;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR)
+            nCodeSeparators++;
+    }
+    ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
+    it = itBegin;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR) {
+            s.write((char*)&itBegin[0], it-itBegin-1);
+            itBegin = it;
+        }
+    }
+    if (itBegin != scriptCode.end())
+        s.write((char*)&itBegin[0], it-itBegin);
+}
+
+/** Stream that feeds everything written to it into a SHA256 hasher */
+class CSHA256Writer {
+private:
+    CSHA256& sha;
+
+public:
+    explicit CSHA256Writer(CSHA256& shaIn) : sha(shaIn) {}
+
+    CSHA256Writer& write(const char* pch, size_t size) {
+        sha.Write((const unsigned char*)pch, size);
+        return *this;
+    }
+};
+
+/** Size of an input serialized with a blanked script: prevout, empty script, nSequence */
+const size_t BLANK_INPUT_SIZE = 36 + 1 + 4;
+
 /**
  * Wrapper that serializes like CTransaction, but with the modifications
  *  required for the signature hash done in-place
@@ -1010,24 +1051,7 @@ public:
     /** Serialize the passed scriptCode, skipping OP_CODESEPARATORs */
     template<typename S>
     void SerializeScriptCode(S &s, int nType, int nVersion) const {
-        CScript::const_iterator it = scriptCode.begin();
-        CScript::const_iterator itBegin = it;
-        opcodetype opcode;
-        unsigned int nCodeSeparators = 0;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR)
-                nCodeSeparators++;
-        }
-        ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
-        it = itBegin;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR) {
-                s.write((char*)&itBegin[0], it-itBegin-1);
-                itBegin = it;
-            }
-        }
-        if (itBegin != scriptCode.end())
-            s.write((char*)&itBegin[0], it-itBegin);
+        ::SerializeScriptCode(s, scriptCode);
     }
 
     /** Serialize an input of txTo */
@@ -1084,7 +1108,62 @@ public:
 
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    // With a single input there is nothing to share
+    if (txTo.vin.size() < 2)
+        return;
+
+    CDataStream ssInputs(SER_GETHASH, 0);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        ssInputs << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+    assert(ssInputs.size() == txTo.vin.size() * BLANK_INPUT_SIZE);
+    vBlankInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    vOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+
+    CSHA256 sha;
+    CSHA256Writer s(sha);
+    ::Serialize(s, txTo.nVersion, SER_GETHASH, 0);
+    ::WriteCompactSize(s, txTo.vin.size());
+    vPrefix.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vPrefix.push_back(sha);
+        sha.Write(&vBlankInputs[i * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE);
+    }
+}
+
+bool PrecomputedTransactionData::SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const
+{
+    if (nIn >= vPrefix.size())
+        return false;
+
+    // Only hash types that commit to all inputs and outputs unmodified share the serialization
+    if ((nHashType & SIGHASH_ANYONECANPAY) || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return false;
+
+    // Same bytes as CTransactionSignatureSerializer, starting from the hasher state before input nIn
+    const unsigned char* pinput = &vBlankInputs[nIn * BLANK_INPUT_SIZE];
+    CSHA256 sha(vPrefix[nIn]);
+    CSHA256Writer s(sha);
+    sha.Write(pinput, 36);
+    SerializeScriptCode(s, scriptCode);
+    sha.Write(pinput + 37, 4);
+    size_t nAfter = (nIn + 1) * BLANK_INPUT_SIZE;
+    if (nAfter < vBlankInputs.size())
+        sha.Write(&vBlankInputs[nAfter], vBlankInputs.size() - nAfter);
+    sha.Write(&vOutputs[0], vOutputs.size());
+    ::Serialize(s, nHashType, SER_GETHASH, 0);
+
+    unsigned char buf[CSHA256::OUTPUT_SIZE];
+    sha.Finalize(buf);
+    CSHA256().Write(buf, CSHA256::OUTPUT_SIZE).Finalize(hashRet.begin());
+    return true;
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     if (nIn >= txTo.vin.size()) {
         //  nIn out of range
@@ -1099,6 +1178,10 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    uint256 hash;
+    if (txdata && txdata->SignatureHash(scriptCode, nIn, nHashType, hash))
+        return hash;
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
@@ -1126,7 +1209,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
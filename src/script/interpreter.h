@@ -7,6 +7,7 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "crypto/sha256.h"
 #include "primitives/transaction.h"
 
 #include <vector>
@@ -84,7 +85,31 @@ enum
 
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * The parts of a transaction's serialization that are shared by the
+ * SIGHASH_ALL signature hashes of all its inputs, computed once so that
+ * checking or signing every input does not reserialize the transaction.
+ * Other inputs' scripts are blanked in those hashes, so the data stays valid
+ * while scriptSigs are filled in. Left empty for single-input transactions.
+ */
+class PrecomputedTransactionData
+{
+private:
+    //! Every input serialized with an empty script (prevout, 0x00, nSequence)
+    std::vector<unsigned char> vBlankInputs;
+    //! Outputs and nLockTime, serialized
+    std::vector<unsigned char> vOutputs;
+    //! vPrefix[i]: hasher state after nVersion, the input count and the first i blank inputs
+    std::vector<CSHA256> vPrefix;
+
+public:
+    explicit PrecomputedTransactionData(const CTransaction& txTo);
+
+    /** Compute the signature hash from the shared data; returns false if the hash type needs the full serializer. */
+    bool SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const;
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -104,12 +129,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
 };
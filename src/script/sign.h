@@ -21,6 +21,16 @@ bool Sign1(const CKeyID& address, const CKeyStore& keystore, uint256 hash, int n
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 
+/**
+ * Sign input nIn of txTo against txToConst, a copy of txTo taken before signing, and
+ * txdata computed from it. Filling in scriptSigs does not change what any input's
+ * signature hash commits to, so one copy serves every input of the transaction.
+ */
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CTransaction& txToConst, const PrecomputedTransactionData& txdata);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CTransaction& txToConst, const PrecomputedTransactionData& txdata);
+
 /**
  * Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
  * combine them intelligently and return the result.
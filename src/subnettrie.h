@@ -0,0 +1,216 @@
+// Copyright (c) 2018 The StakeCenterCash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUBNETTRIE_H
+#define BITCOIN_SUBNETTRIE_H
+
+#include "netbase.h"
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Binary prefix trie mapping subnets to values.
+ *
+ * Every CNetAddr is stored as 16 bytes (IPv4 and onion addresses use their
+ * mapped IPv6 form), so one trie over the 128 address bits serves all
+ * networks. Looking up an address walks at most one node per address bit,
+ * independent of the number of stored subnets.
+ *
+ * Subnets with a non-contiguous netmask (only possible with the full netmask
+ * syntax, e.g. 255.0.255.0) cannot be represented as a prefix and are kept
+ * in a side list that is scanned linearly.
+ */
+template <typename T>
+class CSubNetTrie
+{
+private:
+    struct Node {
+        int32_t children[2];
+        bool fHasValue;
+        T value;
+
+        Node() : fHasValue(false), value()
+        {
+            children[0] = children[1] = -1;
+        }
+    };
+
+    std::vector<Node> vNodes;           //! vNodes[0] is the root, matching every address
+    std::vector<int32_t> vFreeNodes;    //! indexes of pruned nodes available for reuse
+    std::vector<std::pair<CSubNet, T> > vIrregular;
+    size_t nValues;
+
+    static int GetBit(const CNetAddr& addr, int nBit)
+    {
+        return (addr.GetByte(15 - (nBit >> 3)) >> (7 - (nBit & 7))) & 1;
+    }
+
+    int32_t NewNode()
+    {
+        if (!vFreeNodes.empty()) {
+            int32_t n = vFreeNodes.back();
+            vFreeNodes.pop_back();
+            vNodes[n] = Node();
+            return n;
+        }
+        vNodes.push_back(Node());
+        return vNodes.size() - 1;
+    }
+
+    //! Index of the node for exactly this prefix, or -1
+    int32_t FindNode(const CNetAddr& network, int nPrefixLength) const
+    {
+        int32_t n = 0;
+        for (int nBit = 0; nBit < nPrefixLength && n >= 0; ++nBit)
+            n = vNodes[n].children[GetBit(network, nBit)];
+        return n;
+    }
+
+public:
+    CSubNetTrie() : nValues(0)
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        vNodes.assign(1, Node());
+        vFreeNodes.clear();
+        vIrregular.clear();
+        nValues = 0;
+    }
+
+    size_t size() const { return nValues; }
+    bool empty() const { return nValues == 0; }
+
+    /** Insert or overwrite the value stored for subNet. Invalid subnets are ignored. */
+    void insert(const CSubNet& subNet, const T& value)
+    {
+        if (!subNet.IsValid())
+            return;
+        int nPrefixLength = subNet.GetPrefixLength();
+        if (nPrefixLength < 0) {
+            for (unsigned int i = 0; i < vIrregular.size(); i++) {
+                if (vIrregular[i].first == subNet) {
+                    vIrregular[i].second = value;
+                    return;
+                }
+            }
+            vIrregular.push_back(std::make_pair(subNet, value));
+            nValues++;
+            return;
+        }
+
+        int32_t n = 0;
+        for (int nBit = 0; nBit < nPrefixLength; ++nBit) {
+            int b = GetBit(subNet.GetNetwork(), nBit);
+            if (vNodes[n].children[b] < 0) {
+                int32_t nChild = NewNode();
+                vNodes[n].children[b] = nChild;
+            }
+            n = vNodes[n].children[b];
+        }
+        if (!vNodes[n].fHasValue)
+            nValues++;
+        vNodes[n].fHasValue = true;
+        vNodes[n].value = value;
+    }
+
+    /** Remove the entry for exactly this subnet. Returns false if there was none. */
+    bool erase(const CSubNet& subNet)
+    {
+        int nPrefixLength = subNet.GetPrefixLength();
+        if (nPrefixLength < 0) {
+            for (unsigned int i = 0; i < vIrregular.size(); i++) {
+                if (vIrregular[i].first == subNet) {
+                    vIrregular.erase(vIrregular.begin() + i);
+                    nValues--;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        std::vector<int32_t> vPath;
+        vPath.reserve(nPrefixLength + 1);
+        int32_t n = 0;
+        vPath.push_back(n);
+        for (int nBit = 0; nBit < nPrefixLength; ++nBit) {
+            n = vNodes[n].children[GetBit(subNet.GetNetwork(), nBit)];
+            if (n < 0)
+                return false;
+            vPath.push_back(n);
+        }
+        if (!vNodes[n].fHasValue)
+            return false;
+        vNodes[n].fHasValue = false;
+        vNodes[n].value = T();
+        nValues--;
+
+        // Prune nodes that no longer lead to any value
+        for (int nBit = nPrefixLength - 1; nBit >= 0; --nBit) {
+            const Node& node = vNodes[vPath[nBit + 1]];
+            if (node.fHasValue || node.children[0] >= 0 || node.children[1] >= 0)
+                break;
+            vFreeNodes.push_back(vPath[nBit + 1]);
+            vNodes[vPath[nBit]].children[GetBit(subNet.GetNetwork(), nBit)] = -1;
+        }
+        return true;
+    }
+
+    /** Value stored for exactly this subnet, or NULL */
+    const T* find(const CSubNet& subNet) const
+    {
+        int nPrefixLength = subNet.GetPrefixLength();
+        if (nPrefixLength < 0) {
+            for (unsigned int i = 0; i < vIrregular.size(); i++)
+                if (vIrregular[i].first == subNet)
+                    return &vIrregular[i].second;
+            return NULL;
+        }
+        int32_t n = FindNode(subNet.GetNetwork(), nPrefixLength);
+        if (n < 0 || !vNodes[n].fHasValue)
+            return NULL;
+        return &vNodes[n].value;
+    }
+
+    /**
+     * Returns true if any stored subnet containing addr has a value for
+     * which pred(value) is true.
+     */
+    template <typename Predicate>
+    bool MatchAny(const CNetAddr& addr, Predicate pred) const
+    {
+        if (!addr.IsValid())
+            return false;
+        int32_t n = 0;
+        for (int nBit = 0; n >= 0; ++nBit) {
+            const Node& node = vNodes[n];
+            if (node.fHasValue && pred(node.value))
+                return true;
+            if (nBit == 128)
+                break;
+            n = node.children[GetBit(addr, nBit)];
+        }
+        for (unsigned int i = 0; i < vIrregular.size(); i++)
+            if (vIrregular[i].first.Match(addr) && pred(vIrregular[i].second))
+                return true;
+        return false;
+    }
+
+    /** Returns true if any stored subnet contains addr */
+    bool Match(const CNetAddr& addr) const
+    {
+        return MatchAny(addr, AlwaysTrue());
+    }
+
+private:
+    struct AlwaysTrue {
+        bool operator()(const T&) const { return true; }
+    };
+};
+
+#endif // BITCOIN_SUBNETTRIE_H
@@ -0,0 +1,128 @@
+// Copyright (c) 2018 The StakeCenterCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "masternodeman.h"
+#include "primitives/block.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternode_lastpaid_tests)
+
+static CScript PayeeScript(unsigned char c)
+{
+    return CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, c) << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+// proof of work block whose coinbase pays the miner and then the payee
+static CBlock PaymentBlock(const CScript& payee)
+{
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(2);
+    coinbase.vout[0].scriptPubKey = PayeeScript(0xff);
+    coinbase.vout[0].nValue = 1;
+    coinbase.vout[1].scriptPubKey = payee;
+    coinbase.vout[1].nValue = 1;
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    return block;
+}
+
+struct LastPaidChain {
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+
+    LastPaidChain(int nBlocks) : vHashes(nBlocks), vIndex(nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++) {
+            vHashes[i] = uint256(i + 1);
+            vIndex[i].phashBlock = &vHashes[i];
+            vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+            vIndex[i].nHeight = i;
+            vIndex[i].nTime = 1000 + i * 60;
+        }
+    }
+};
+
+BOOST_AUTO_TEST_CASE(lastpaid_connect_undo)
+{
+    CMasternodeMan man;
+    LastPaidChain chain(10);
+    CScript payeeA = PayeeScript(0x01);
+    CScript payeeB = PayeeScript(0x02);
+    int nHeight;
+    int64_t nTime;
+
+    BOOST_CHECK(!man.GetLastPaid(payeeA, nHeight, nTime));
+
+    man.UpdateLastPaid(PaymentBlock(payeeA), &chain.vIndex[3]);
+    man.UpdateLastPaid(PaymentBlock(payeeB), &chain.vIndex[4]);
+    BOOST_CHECK(man.GetLastPaid(payeeA, nHeight, nTime));
+    BOOST_CHECK_EQUAL(nHeight, 3);
+    BOOST_CHECK_EQUAL(nTime, chain.vIndex[3].GetBlockTime());
+
+    // connecting the same block again does not add a payment
+    man.UpdateLastPaid(PaymentBlock(payeeA), &chain.vIndex[3]);
+    man.UndoLastPaid(PaymentBlock(payeeA), &chain.vIndex[3]);
+    BOOST_CHECK(!man.GetLastPaid(payeeA, nHeight, nTime));
+
+    // undoing a block that did not pay the payee leaves it alone
+    man.UndoLastPaid(PaymentBlock(payeeA), &chain.vIndex[4]);
+    BOOST_CHECK(man.GetLastPaid(payeeB, nHeight, nTime));
+    BOOST_CHECK_EQUAL(nHeight, 4);
+}
+
+BOOST_AUTO_TEST_CASE(lastpaid_undo_two_blocks_same_payee)
+{
+    CMasternodeMan man;
+    LastPaidChain chain(10);
+    CScript payee = PayeeScript(0x01);
+    int nHeight;
+    int64_t nTime;
+
+    man.UpdateLastPaid(PaymentBlock(payee), &chain.vIndex[2]);
+    man.UpdateLastPaid(PaymentBlock(payee), &chain.vIndex[5]);
+    man.UpdateLastPaid(PaymentBlock(payee), &chain.vIndex[6]);
+
+    man.UndoLastPaid(PaymentBlock(payee), &chain.vIndex[6]);
+    BOOST_CHECK(man.GetLastPaid(payee, nHeight, nTime));
+    BOOST_CHECK_EQUAL(nHeight, 5);
+
+    man.UndoLastPaid(PaymentBlock(payee), &chain.vIndex[5]);
+    BOOST_CHECK(man.GetLastPaid(payee, nHeight, nTime));
+    BOOST_CHECK_EQUAL(nHeight, 2);
+    BOOST_CHECK_EQUAL(nTime, chain.vIndex[2].GetBlockTime());
+
+    man.UndoLastPaid(PaymentBlock(payee), &chain.vIndex[2]);
+    BOOST_CHECK(!man.GetLastPaid(payee, nHeight, nTime));
+}
+
+BOOST_AUTO_TEST_CASE(lastpaid_prune)
+{
+    CMasternodeMan man;
+    LastPaidChain chain(10);
+    CScript payeeA = PayeeScript(0x01);
+    CScript payeeB = PayeeScript(0x02);
+    int nHeight;
+    int64_t nTime;
+
+    man.UpdateLastPaid(PaymentBlock(payeeA), &chain.vIndex[1]);
+    man.UpdateLastPaid(PaymentBlock(payeeA), &chain.vIndex[7]);
+    man.UpdateLastPaid(PaymentBlock(payeeB), &chain.vIndex[8]);
+
+    // the active chain only reaches height 5, later payments are dropped
+    man.PruneLastPaid(5);
+    BOOST_CHECK(man.GetLastPaid(payeeA, nHeight, nTime));
+    BOOST_CHECK_EQUAL(nHeight, 1);
+    BOOST_CHECK(!man.GetLastPaid(payeeB, nHeight, nTime));
+
+    // payments deeper than the index keeps are dropped
+    man.PruneLastPaid(1 + MASTERNODES_LAST_PAID_DEPTH + 1);
+    BOOST_CHECK(!man.GetLastPaid(payeeA, nHeight, nTime));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -99,4 +99,204 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    // Chain of three transactions, parent -> child -> grandchild,
+    // plus an unrelated transaction
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+        if (i > 0 && i < 3) {
+            tx[i].vin[0].prevout.hash = tx[i - 1].GetHash();
+            tx[i].vin[0].prevout.n = 0;
+        }
+    }
+    tx[3].vout[0].nValue = 5 * COIN;
+
+    CTxMemPool pool(CFeeRate(0));
+    CTxMemPoolEntry entry[4] = {
+        CTxMemPoolEntry(tx[0], 1000, 0, 0.0, 1),
+        CTxMemPoolEntry(tx[1], 50000, 0, 0.0, 1),
+        CTxMemPoolEntry(tx[2], 2000, 0, 0.0, 1),
+        CTxMemPoolEntry(tx[3], 10000, 0, 0.0, 1)};
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(tx[i].GetHash(), entry[i]);
+    const CAmount nSize = entry[0].GetTxSize();
+
+    CTxMemPool::txiter it0 = pool.mapTx.find(tx[0].GetHash());
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx[1].GetHash());
+    CTxMemPool::txiter it2 = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it0->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it0->GetModFeesWithDescendants(), 53000);
+    BOOST_CHECK_EQUAL(it0->GetSizeWithDescendants(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it1->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), 53000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it0).size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(it2).size(), 1);
+
+    // By fee rate alone tx[1] comes first, tx[0] last
+    CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator mi = pool.mapTx.get<mining_score>().begin();
+    BOOST_CHECK(mi->GetTx().GetHash() == tx[1].GetHash());
+    BOOST_CHECK((++mi)->GetTx().GetHash() == tx[3].GetHash());
+
+    // By package fee rate tx[1] (with tx[0]) comes first, then tx[2] (with both), then tx[3]
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ai = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(ai->GetTx().GetHash() == tx[1].GetHash());
+    BOOST_CHECK((++ai)->GetTx().GetHash() == tx[2].GetHash());
+    BOOST_CHECK((++ai)->GetTx().GetHash() == tx[3].GetHash());
+
+    // Prioritising the root raises the package totals of its descendants
+    unsigned int nUpdated = pool.GetTransactionsUpdated();
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 100000);
+    BOOST_CHECK(pool.GetTransactionsUpdated() != nUpdated);
+    it0 = pool.mapTx.find(tx[0].GetHash());
+    it2 = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it0->GetModifiedFee(), 101000);
+    BOOST_CHECK_EQUAL(it0->GetModFeesWithDescendants(), 153000);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), 153000);
+
+    // Confirming the root in a block leaves its descendants with one ancestor less
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(tx[0]));
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    it1 = pool.mapTx.find(tx[1].GetHash());
+    it2 = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), 52000);
+
+    // Re-adding it (as after a reorg) links it to the children still in the pool
+    pool.addUnchecked(tx[0].GetHash(), entry[0]);
+    it0 = pool.mapTx.find(tx[0].GetHash());
+    it2 = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it0->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it0->GetModFeesWithDescendants(), 53000);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(pool.mapTx.find(tx[1].GetHash())).size(), 1);
+
+    // Removing the middle transaction recursively takes the grandchild along
+    std::list<CTransaction> removed;
+    pool.remove(tx[1], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    it0 = pool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it0->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(it0->GetSizeWithDescendants(), nSize);
+    BOOST_CHECK(pool.GetMemPoolChildren(it0).empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // tx[0] and tx[3] stand alone, tx[1] is a low fee parent of the high fee tx[2]
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_1;
+        tx[i].vin[0].prevout.n = i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    tx[2].vin[0].prevout.hash = tx[1].GetHash();
+    tx[2].vin[0].prevout.n = 0;
+
+    const CAmount nFees[4] = {10000, 5000, 20000, 1000};
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFees[i], 0, 0.0, 1));
+    unsigned int nSize = ::GetSerializeSize(tx[3], SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(pool.DynamicMemoryUsage() > 0);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // The lowest fee rate package goes first and sets the minimum fee
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx[3].GetHash()));
+    BOOST_CHECK(pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.exists(tx[1].GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), CFeeRate(nFees[3], nSize).GetFeePerK() + 1000);
+
+    // tx[1] is kept by its child, so tx[0] is next
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.exists(tx[1].GetHash()));
+    BOOST_CHECK(pool.exists(tx[2].GetHash()));
+
+    // Packages are evicted as a whole
+    pool.TrimToSize(1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+    CFeeRate maxRemoved = pool.GetMinFee(1);
+    BOOST_CHECK(maxRemoved > CFeeRate(nFees[0], nSize));
+
+    // The minimum fee only decays after a block and drops to zero eventually
+    SetMockTime(42);
+    std::vector<CTransactionRef> vtx;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1) < maxRemoved);
+    SetMockTime(42 + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIncrementalCheckTest)
+{
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(&coinsDummy);
+
+    CMutableTransaction txFunding;
+    txFunding.vout.resize(1);
+    txFunding.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txFunding.vout[0].nValue = 100000LL;
+    coins.ModifyCoins(txFunding.GetHash())->FromTx(txFunding, 1);
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 90000LL;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 80000LL;
+
+    CTxMemPool pool(CFeeRate(0));
+    pool.setCheckBudget(1000000);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 10000LL, 0, 10.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 10000LL, 0, 10.0, 1));
+    BOOST_CHECK_EQUAL(pool.checkIncremental(&coins), 0);
+
+    // Corrupt the pool behind its back: unchanged entries are not checked again
+    pool.mapNextTx.erase(txChild.vin[0].prevout);
+    BOOST_CHECK_EQUAL(pool.checkIncremental(&coins), 0);
+
+    // Touching the child queues it and its parent again, and both see that
+    // the child's input is missing from mapNextTx
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0, 1000LL);
+    BOOST_CHECK_EQUAL(pool.checkIncremental(&coins), 2);
+    BOOST_CHECK_EQUAL(pool.GetCheckFailures(), 2);
+    BOOST_CHECK_EQUAL(pool.checkIncremental(&coins), 0);
+
+    // Restore mapNextTx; a missing coin is found once the entry is queued
+    pool.mapNextTx[txChild.vin[0].prevout] = CInPoint(&pool.mapTx.find(txChild.GetHash())->GetTx(), 0);
+    CCoinsViewCache coinsEmpty(&coinsDummy);
+    pool.setCheckBudget(1000000);
+    BOOST_CHECK_EQUAL(pool.checkIncremental(&coinsEmpty), 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,253 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2018 The StakeCenterCash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "prevector.h"
+
+#include "core_memusage.h"
+#include "random.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(prevector_tests)
+
+template <unsigned int N, typename T>
+class prevector_tester
+{
+    typedef std::vector<T> realtype;
+    realtype real_vector;
+
+    typedef prevector<N, T> pretype;
+    pretype pre_vector;
+
+    typedef typename pretype::size_type Size;
+
+    void test()
+    {
+        const pretype& const_pre_vector = pre_vector;
+        BOOST_CHECK_EQUAL(real_vector.size(), pre_vector.size());
+        BOOST_CHECK_EQUAL(real_vector.empty(), pre_vector.empty());
+        for (Size s = 0; s < real_vector.size(); s++) {
+            BOOST_CHECK(real_vector[s] == pre_vector[s]);
+            BOOST_CHECK(&(pre_vector[s]) == &(pre_vector.begin()[s]));
+            BOOST_CHECK(&(pre_vector[s]) == &*(pre_vector.begin() + s));
+            BOOST_CHECK(&(pre_vector[s]) == &*((pre_vector.end() + s) - real_vector.size()));
+        }
+        BOOST_CHECK(pre_vector == pretype(real_vector.begin(), real_vector.end()));
+        size_t pos = 0;
+        for (typename pretype::const_iterator it = const_pre_vector.begin(); it != const_pre_vector.end(); ++it) {
+            BOOST_CHECK(*it == real_vector[pos++]);
+        }
+        CDataStream ss1(SER_DISK, 0);
+        CDataStream ss2(SER_DISK, 0);
+        ss1 << real_vector;
+        ss2 << pre_vector;
+        BOOST_CHECK_EQUAL(ss1.size(), ss2.size());
+        for (Size s = 0; s < ss1.size(); s++) {
+            BOOST_CHECK_EQUAL(ss1[s], ss2[s]);
+        }
+        pretype pre_vector_copy;
+        ss2 >> pre_vector_copy;
+        BOOST_CHECK(pre_vector_copy == pre_vector);
+    }
+
+public:
+    void resize(Size s)
+    {
+        real_vector.resize(s);
+        BOOST_CHECK_EQUAL(real_vector.size(), s);
+        pre_vector.resize(s);
+        BOOST_CHECK_EQUAL(pre_vector.size(), s);
+        test();
+    }
+
+    void reserve(Size s)
+    {
+        real_vector.reserve(s);
+        BOOST_CHECK(real_vector.capacity() >= s);
+        pre_vector.reserve(s);
+        BOOST_CHECK(pre_vector.capacity() >= s);
+        test();
+    }
+
+    void insert(Size position, const T& value)
+    {
+        real_vector.insert(real_vector.begin() + position, value);
+        pre_vector.insert(pre_vector.begin() + position, value);
+        test();
+    }
+
+    void insert(Size position, Size count, const T& value)
+    {
+        real_vector.insert(real_vector.begin() + position, count, value);
+        pre_vector.insert(pre_vector.begin() + position, count, value);
+        test();
+    }
+
+    void erase(Size position)
+    {
+        real_vector.erase(real_vector.begin() + position);
+        pre_vector.erase(pre_vector.begin() + position);
+        test();
+    }
+
+    void erase(Size first, Size last)
+    {
+        real_vector.erase(real_vector.begin() + first, real_vector.begin() + last);
+        pre_vector.erase(pre_vector.begin() + first, pre_vector.begin() + last);
+        test();
+    }
+
+    void update(Size pos, const T& value)
+    {
+        real_vector[pos] = value;
+        pre_vector[pos] = value;
+        test();
+    }
+
+    void push_back(const T& value)
+    {
+        real_vector.push_back(value);
+        pre_vector.push_back(value);
+        test();
+    }
+
+    void pop_back()
+    {
+        real_vector.pop_back();
+        pre_vector.pop_back();
+        test();
+    }
+
+    void clear()
+    {
+        real_vector.clear();
+        pre_vector.clear();
+    }
+
+    void assign(Size n, const T& value)
+    {
+        real_vector.assign(n, value);
+        pre_vector.assign(n, value);
+    }
+
+    Size size()
+    {
+        return real_vector.size();
+    }
+
+    Size capacity()
+    {
+        return pre_vector.capacity();
+    }
+
+    void shrink_to_fit()
+    {
+        pre_vector.shrink_to_fit();
+        test();
+    }
+};
+
+BOOST_AUTO_TEST_CASE(PrevectorTestInt)
+{
+    for (int j = 0; j < 64; j++) {
+        prevector_tester<8, int> test;
+        for (int i = 0; i < 2048; i++) {
+            int r = insecure_rand();
+            if ((r % 4) == 0) {
+                test.insert(insecure_rand() % (test.size() + 1), insecure_rand());
+            }
+            if (test.size() > 0 && ((r >> 2) % 4) == 1) {
+                test.erase(insecure_rand() % test.size());
+            }
+            if (((r >> 4) % 8) == 2) {
+                int new_size = std::max<int>(0, std::min<int>(30, test.size() + (insecure_rand() % 5) - 2));
+                test.resize(new_size);
+            }
+            if (((r >> 7) % 8) == 3) {
+                test.insert(insecure_rand() % (test.size() + 1), 1 + (insecure_rand() % 2), insecure_rand());
+            }
+            if (((r >> 10) % 8) == 4) {
+                int del = std::min<int>(test.size(), 1 + (insecure_rand() % 2));
+                int beg = insecure_rand() % (test.size() + 1 - del);
+                test.erase(beg, beg + del);
+            }
+            if (((r >> 13) % 16) == 5) {
+                test.push_back(insecure_rand());
+            }
+            if (test.size() > 0 && ((r >> 17) % 16) == 6) {
+                test.pop_back();
+            }
+            if (((r >> 26) % 32) == 8) {
+                int del = std::min<int>(test.size(), 1 + (insecure_rand() % 4));
+                int beg = insecure_rand() % (test.size() + 1 - del);
+                test.erase(beg, beg + del);
+            }
+            r = insecure_rand();
+            if (r % 32 == 9) {
+                test.reserve(insecure_rand() % 32);
+            }
+            if ((r >> 5) % 64 == 10) {
+                test.shrink_to_fit();
+            }
+            if (test.size() > 0) {
+                test.update(insecure_rand() % test.size(), insecure_rand());
+            }
+            if (((r >> 11) % 1024) == 11) {
+                test.clear();
+            }
+            if (((r >> 21) % 512) == 12) {
+                test.assign(insecure_rand() % 32, insecure_rand());
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_serialization_unchanged)
+{
+    // A script must serialize byte-for-byte like the vector it used to be
+    std::vector<unsigned char> vch(100);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = (unsigned char)i;
+    for (unsigned int len = 0; len <= vch.size(); len += 7) {
+        CScript script(vch.begin(), vch.begin() + len);
+        std::vector<unsigned char> raw(vch.begin(), vch.begin() + len);
+        CDataStream ss1(SER_NETWORK, 0);
+        CDataStream ss2(SER_NETWORK, 0);
+        ss1 << script;
+        ss2 << raw;
+        BOOST_CHECK(ss1.str() == ss2.str());
+        BOOST_CHECK_EQUAL(ss1.size(), ::GetSerializeSize(script, SER_NETWORK, 0));
+
+        CScript script2;
+        ss1 >> script2;
+        BOOST_CHECK(script2 == script);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_inline_storage)
+{
+    // Pay-to-pubkey-hash and pay-to-script-hash outputs fit without a heap allocation
+    uint160 hash;
+    CScript p2pkh = CScript() << OP_DUP << OP_HASH160 << ToByteVector(hash) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript p2sh = CScript() << OP_HASH160 << ToByteVector(hash) << OP_EQUAL;
+    BOOST_CHECK_EQUAL(p2pkh.size(), 25U);
+    BOOST_CHECK_EQUAL(RecursiveDynamicUsage(p2pkh), 0U);
+    BOOST_CHECK_EQUAL(RecursiveDynamicUsage(p2sh), 0U);
+
+    // Longer scripts spill to the heap, and clear() gives the memory back
+    std::vector<unsigned char> nops(100, OP_NOP);
+    CScript big(nops.begin(), nops.end());
+    BOOST_CHECK(RecursiveDynamicUsage(big) > 0);
+    big.clear();
+    BOOST_CHECK_EQUAL(RecursiveDynamicUsage(big), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
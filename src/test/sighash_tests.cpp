@@ -160,6 +160,34 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<2000; i++) {
+        int nHashType = insecure_rand();
+        // Favour the hash types that take the precomputed path
+        if (i % 2 == 0)
+            nHashType = (nHashType & ~0x9f) | SIGHASH_ALL;
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+
+        const CTransaction tx(txTo);
+        const PrecomputedTransactionData txdata(tx);
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++)
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, &txdata) == SignatureHash(scriptCode, tx, nIn, nHashType));
+
+        // Filling in scriptSigs must not invalidate the precomputed data
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+            RandomScript(txTo.vin[nIn].scriptSig);
+        const CTransaction txSigned(txTo);
+        unsigned int nIn = insecure_rand() % txTo.vin.size();
+        BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, &txdata) == SignatureHash(scriptCode, txSigned, nIn, nHashType));
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
@@ -0,0 +1,114 @@
+// Copyright (c) 2018 The StakeCenterCash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "subnettrie.h"
+
+#include "netbase.h"
+#include "tinyformat.h"
+
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(subnettrie_tests)
+
+BOOST_AUTO_TEST_CASE(subnettrie_match)
+{
+    CSubNetTrie<int> trie;
+    BOOST_CHECK(!trie.Match(CNetAddr("1.2.3.4")));
+
+    trie.insert(CSubNet("1.2.0.0/16"), 1);
+    trie.insert(CSubNet("1.2.3.4"), 2);
+    trie.insert(CSubNet("2a01:4f8::/32"), 3);
+    trie.insert(CSubNet("FD87:D87E:EB43::/48"), 4);
+    BOOST_CHECK_EQUAL(trie.size(), 4U);
+
+    BOOST_CHECK(trie.Match(CNetAddr("1.2.3.4")));
+    BOOST_CHECK(trie.Match(CNetAddr("1.2.255.255")));
+    BOOST_CHECK(!trie.Match(CNetAddr("1.3.0.0")));
+    BOOST_CHECK(trie.Match(CNetAddr("2a01:4f8::1")));
+    BOOST_CHECK(!trie.Match(CNetAddr("2a01:4f9::1")));
+    BOOST_CHECK(trie.Match(CNetAddr("FD87:D87E:EB43:edb1:8e4:3588:e546:35ca")));
+    BOOST_CHECK(!trie.Match(CNetAddr("::ffff:1.3.0.0")));
+
+    // Exact lookups
+    BOOST_CHECK(trie.find(CSubNet("1.2.0.0/16")) && *trie.find(CSubNet("1.2.0.0/16")) == 1);
+    BOOST_CHECK(trie.find(CSubNet("1.2.3.4/32")) && *trie.find(CSubNet("1.2.3.4/32")) == 2);
+    BOOST_CHECK(!trie.find(CSubNet("1.2.0.0/24")));
+
+    // Overwrite keeps the size
+    trie.insert(CSubNet("1.2.0.0/16"), 5);
+    BOOST_CHECK_EQUAL(trie.size(), 4U);
+    BOOST_CHECK_EQUAL(*trie.find(CSubNet("1.2.0.0/16")), 5);
+
+    // Erase only removes the exact subnet
+    BOOST_CHECK(trie.erase(CSubNet("1.2.0.0/16")));
+    BOOST_CHECK(!trie.erase(CSubNet("1.2.0.0/16")));
+    BOOST_CHECK(trie.Match(CNetAddr("1.2.3.4")));
+    BOOST_CHECK(!trie.Match(CNetAddr("1.2.3.5")));
+    BOOST_CHECK(trie.erase(CSubNet("1.2.3.4")));
+    BOOST_CHECK(!trie.Match(CNetAddr("1.2.3.4")));
+    BOOST_CHECK_EQUAL(trie.size(), 2U);
+
+    trie.clear();
+    BOOST_CHECK(trie.empty());
+    BOOST_CHECK(!trie.Match(CNetAddr("2a01:4f8::1")));
+}
+
+struct GreaterThan {
+    int n;
+    explicit GreaterThan(int nIn) : n(nIn) {}
+    bool operator()(int v) const { return v > n; }
+};
+
+BOOST_AUTO_TEST_CASE(subnettrie_predicate)
+{
+    CSubNetTrie<int> trie;
+    trie.insert(CSubNet("10.0.0.0/8"), 10);
+    trie.insert(CSubNet("10.1.0.0/16"), 20);
+
+    // Every covering subnet is considered, not only the most specific one
+    BOOST_CHECK(trie.MatchAny(CNetAddr("10.1.2.3"), GreaterThan(15)));
+    BOOST_CHECK(!trie.MatchAny(CNetAddr("10.2.2.3"), GreaterThan(15)));
+    BOOST_CHECK(trie.MatchAny(CNetAddr("10.2.2.3"), GreaterThan(5)));
+    BOOST_CHECK(!trie.MatchAny(CNetAddr("10.1.2.3"), GreaterThan(25)));
+}
+
+BOOST_AUTO_TEST_CASE(subnettrie_noncontiguous)
+{
+    CSubNetTrie<int> trie;
+    CSubNet subnet("1.0.3.0/255.0.255.0");
+    BOOST_CHECK(subnet.IsValid());
+    BOOST_CHECK_EQUAL(subnet.GetPrefixLength(), -1);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.0.0/16").GetPrefixLength(), 96 + 16);
+
+    trie.insert(subnet, 1);
+    BOOST_CHECK(trie.Match(CNetAddr("1.7.3.9")));
+    BOOST_CHECK(!trie.Match(CNetAddr("1.7.4.9")));
+    BOOST_CHECK(trie.erase(subnet));
+    BOOST_CHECK(!trie.Match(CNetAddr("1.7.3.9")));
+}
+
+BOOST_AUTO_TEST_CASE(subnettrie_bulk)
+{
+    CSubNetTrie<int> trie;
+    for (int i = 0; i < 256; i++)
+        for (int j = 0; j < 256; j += 4)
+            trie.insert(CSubNet(CNetAddr(strprintf("100.%d.%d.1", i, j))), i);
+    BOOST_CHECK_EQUAL(trie.size(), 256U * 64U);
+    BOOST_CHECK(trie.Match(CNetAddr("100.17.8.1")));
+    BOOST_CHECK(!trie.Match(CNetAddr("100.17.9.1")));
+
+    unsigned int nErased = 0;
+    for (int i = 0; i < 256; i++)
+        for (int j = 0; j < 256; j += 4)
+            nErased += trie.erase(CSubNet(CNetAddr(strprintf("100.%d.%d.1", i, j))));
+    BOOST_CHECK_EQUAL(nErased, 256U * 64U);
+    BOOST_CHECK(trie.empty());
+    BOOST_CHECK(!trie.Match(CNetAddr("100.17.8.1")));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -51,6 +51,6 @@ void UnregisterAllValidationInterfaces() {
     g_signals.UpdatedBlockTip.disconnect_all_slots();
 }
 
-void SyncWithWallets(const CTransaction &tx, const CBlock *pblock = NULL) {
-    g_signals.SyncTransaction(tx, pblock);
+void SyncWithWallets(const CTransactionRef &ptx, const CBlock *pblock = NULL) {
+    g_signals.SyncTransaction(ptx, pblock);
 }
@@ -13,7 +13,7 @@
  */
 
 //! Current Protocol Version
-static const int PROTOCOL_VERSION = 70960;
+static const int PROTOCOL_VERSION = 70961;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -42,5 +42,8 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "dseg" requests for the whole masternode list are answered with "mnblist" chunks starting with this version
+static const int MNBLIST_VERSION = 70961;
+
 
 #endif // BITCOIN_VERSION_H